@@ -0,0 +1,90 @@
+/*
+ * bench - helpers shared by the benchmark programs
+ *
+ * Every program prints a single JSON object
+ *
+ *   {"bench": "<name>", "results": [{...}, ...]}
+ *
+ * on stdout, "make bench" collects them into an array in bench.json.
+ * Diagnostics go to stderr so they never end up in the JSON.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "uloop_timeout.h"
+
+static int _bench_results;
+static int _bench_fields;
+
+static inline int64_t bench_now_ns(void)
+{
+	return clock_monotonic_ns();
+}
+
+static inline void bench_begin(const char *name)
+{
+	printf("{\"bench\": \"%s\", \"results\": [", name);
+	_bench_results = 0;
+}
+
+static inline void bench_end(void)
+{
+	printf("\n]}\n");
+	fflush(stdout);
+}
+
+static inline void bench_result_begin(void)
+{
+	printf("%s\n  {", _bench_results++ ? "," : "");
+	_bench_fields = 0;
+}
+
+static inline void bench_result_end(void)
+{
+	printf("}");
+}
+
+static inline void bench_field_str(const char *key, const char *val)
+{
+	printf("%s\"%s\": \"%s\"", _bench_fields++ ? ", " : "", key, val);
+}
+
+static inline void bench_field_int(const char *key, long long val)
+{
+	printf("%s\"%s\": %lld", _bench_fields++ ? ", " : "", key, val);
+}
+
+static inline void bench_field_double(const char *key, double val)
+{
+	printf("%s\"%s\": %.3f", _bench_fields++ ? ", " : "", key, val);
+}
+
+static int _bench_cmp_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* sort samples in place so bench_percentile() can be used on them */
+static inline void bench_sort(int64_t *samples, int n)
+{
+	qsort(samples, n, sizeof(*samples), _bench_cmp_i64);
+}
+
+/* nearest rank percentile p (0-100) of n sorted samples */
+static inline int64_t bench_percentile(const int64_t *sorted, int n, double p)
+{
+	int i = (int)(n * p / 100.0 + 0.5) - 1;
+
+	if (i < 0)
+		i = 0;
+	if (i >= n)
+		i = n - 1;
+
+	return sorted[i];
+}
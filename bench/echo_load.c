@@ -0,0 +1,393 @@
+/*
+ * echo_load - closed loop load generator for echo_server
+ *
+ * Opens c connections spread over t loops (one thread each) and n server
+ * ports, so more than one port range worth of connections fit on one
+ * loopback address. Every connection keeps exactly one request of s bytes
+ * in flight: it sends, waits for the echo and sends again. Connections are
+ * opened gradually, the measurement starts once all of them are up and
+ * lasts d seconds.
+ *
+ * With -P the server's memory and syscall counters are sampled from /proc:
+ * rss_per_conn is the growth of its resident set while the connections were
+ * opened, rw_syscalls_per_req counts the read and write class syscalls
+ * (syscr + syscw in /proc/<pid>/io) it made per request while measuring.
+ * Waiting for events (epoll_wait, io_uring_enter) is not part of that.
+ */
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "uloop.h"
+#include "uloop_stats.h"
+#include "usock.h"
+#include "bench.h"
+
+/* new connects started per loop and ms, and the most that may be pending */
+#define RAMP_PER_TICK	64
+#define RAMP_PENDING	512
+#define MAX_MSG		4096
+
+struct worker;
+
+struct client {
+	struct uloop_fd fd;
+	struct worker *w;
+	int64_t sent_at;
+	int got;
+	bool connected;
+};
+
+struct worker {
+	pthread_t thread;
+	struct uloop *loop;
+	struct uloop_timeout tick;
+
+	struct client *clients;
+	int nclients;
+	int opened;
+	int pending;
+
+	/* only touched by the worker, read by main once the thread is joined */
+	struct uloop_histogram latency;
+	long long requests;
+};
+
+static const char *host = "127.0.0.1";
+static int port = 7777, nports = 1;
+static int msg_size = 64;
+static char msg[MAX_MSG];
+
+/* shared between the workers and main */
+static int connected, failed;
+static bool measuring, stop;
+
+static int client_send(struct client *c)
+{
+	c->sent_at = bench_now_ns();
+	c->got = 0;
+
+	/* small requests always fit into an empty socket buffer */
+	return write(c->fd.fd, msg, msg_size) == msg_size ? 0 : -1;
+}
+
+static void client_close(struct client *c, bool error)
+{
+	struct worker *w = c->w;
+
+	uloop_remove_fd(w->loop, &c->fd);
+	close(c->fd.fd);
+	c->fd.fd = -1;
+
+	if (!c->connected)
+		w->pending--;
+	if (error)
+		__atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void client_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct client *c = container_of(u, struct client, fd);
+	struct worker *w = c->w;
+	char buf[MAX_MSG];
+	int err = 0;
+	socklen_t len = sizeof(err);
+	ssize_t n;
+
+	if (u->error || u->eof) {
+		client_close(c, true);
+		return;
+	}
+
+	if (!c->connected) {
+		if (getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+			client_close(c, true);
+			return;
+		}
+
+		c->connected = true;
+		w->pending--;
+		__atomic_fetch_add(&connected, 1, __ATOMIC_RELAXED);
+		uloop_add_fd(w->loop, u, ULOOP_READ);
+		if (client_send(c) < 0)
+			client_close(c, true);
+		return;
+	}
+
+	while ((n = read(u->fd, buf, sizeof(buf))) > 0)
+		c->got += n;
+
+	if (!n || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		client_close(c, true);
+		return;
+	}
+
+	if (c->got < msg_size)
+		return;
+
+	if (__atomic_load_n(&measuring, __ATOMIC_RELAXED)) {
+		_uloop_histogram_record(&w->latency, bench_now_ns() - c->sent_at);
+		w->requests++;
+	}
+
+	if (client_send(c) < 0)
+		client_close(c, true);
+}
+
+static void client_open(struct worker *w, struct client *c)
+{
+	char service[16];
+
+	snprintf(service, sizeof(service), "%d", port + (int)(c - w->clients) % nports);
+
+	c->w = w;
+	c->fd.cb = client_cb;
+	c->fd.fd = usock(USOCK_TCP | USOCK_NONBLOCK | USOCK_NUMERIC, host, service);
+	if (c->fd.fd < 0) {
+		__atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	w->pending++;
+	uloop_add_fd(w->loop, &c->fd, ULOOP_WRITE);
+}
+
+/* opens the next connections and gets the loop out of uloop_run() at the end */
+static void worker_tick(struct uloop_timeout *t)
+{
+	struct worker *w = container_of(t, struct worker, tick);
+	int n = 0;
+
+	if (__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		w->loop->cancelled = true;
+		return;
+	}
+
+	while (w->opened < w->nclients && n++ < RAMP_PER_TICK && w->pending < RAMP_PENDING)
+		client_open(w, &w->clients[w->opened++]);
+
+	/* once everything is open, only look for the stop request now and then */
+	uloop_add_timeout_ms(w->loop, t, w->opened < w->nclients ? 1 : 100);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+
+	w->tick.cb = worker_tick;
+	uloop_add_timeout_ms(w->loop, &w->tick, 0);
+	uloop_run(w->loop);
+
+	return NULL;
+}
+
+/*
+ * reads "<key>: <value>" from a /proc file, -1 if it is not there. the
+ * files are opened up front, at the end all fds may be taken by sockets.
+ */
+static long long proc_value(int fd, const char *key)
+{
+	char buf[4096], *line;
+	size_t klen = strlen(key);
+	ssize_t len;
+
+	if (fd < 0 || (len = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0)
+		return -1;
+	buf[len] = 0;
+
+	for (line = buf; line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (!strncmp(line, key, klen) && line[klen] == ':')
+			return atoll(line + klen + 1);
+	}
+
+	return -1;
+}
+
+static int proc_open(int pid, const char *file)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static long long proc_syscalls(int fd)
+{
+	long long r = proc_value(fd, "syscr");
+	long long w = proc_value(fd, "syscw");
+
+	return r < 0 || w < 0 ? -1 : r + w;
+}
+
+static void raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int nconns = 10000, nworkers = 1, duration = 10, server = 0;
+	int status_fd = -1, io_fd = -1;
+	long long rss_before = -1, rss_after = -1, sys_before = -1, sys_after = -1;
+	struct uloop_histogram latency;
+	struct worker *workers;
+	long long requests = 0;
+	int64_t start, elapsed;
+	int ch, i, b, waited;
+
+	while ((ch = getopt(argc, argv, "h:p:n:c:t:d:s:P:")) != -1) {
+		switch (ch) {
+		case 'h':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'n':
+			nports = atoi(optarg);
+			break;
+		case 'c':
+			nconns = atoi(optarg);
+			break;
+		case 't':
+			nworkers = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 'P':
+			server = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-h host] [-p port] [-n ports] [-c connections] "
+				"[-t loops] [-d seconds] [-s message size] [-P server pid]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (nports <= 0 || nconns <= 0 || nworkers <= 0 || duration <= 0 ||
+	    msg_size <= 0 || msg_size > MAX_MSG)
+		return 1;
+
+	raise_nofile();
+	memset(msg, 'x', msg_size);
+
+	if (server) {
+		status_fd = proc_open(server, "status");
+		io_fd = proc_open(server, "io");
+		rss_before = proc_value(status_fd, "VmRSS");
+	}
+
+	workers = calloc(nworkers, sizeof(*workers));
+	if (!workers)
+		return 1;
+
+	for (i = 0; i < nworkers; i++) {
+		struct worker *w = &workers[i];
+
+		w->nclients = nconns / nworkers + (i < nconns % nworkers);
+		w->clients = calloc(w->nclients, sizeof(*w->clients));
+		w->loop = uloop_new();
+		if (!w->clients || !w->loop ||
+		    pthread_create(&w->thread, NULL, worker_thread, w))
+			return 1;
+	}
+
+	/* give up on connections that are not up after a minute */
+	for (waited = 0; waited < 60000; waited += 10) {
+		if (__atomic_load_n(&connected, __ATOMIC_RELAXED) +
+		    __atomic_load_n(&failed, __ATOMIC_RELAXED) >= nconns)
+			break;
+		usleep(10000);
+	}
+	fprintf(stderr, "echo_load: %d connected, %d failed\n",
+		__atomic_load_n(&connected, __ATOMIC_RELAXED),
+		__atomic_load_n(&failed, __ATOMIC_RELAXED));
+
+	if (server) {
+		rss_after = proc_value(status_fd, "VmRSS");
+		sys_before = proc_syscalls(io_fd);
+	}
+
+	start = bench_now_ns();
+	__atomic_store_n(&measuring, true, __ATOMIC_RELAXED);
+	sleep(duration);
+	__atomic_store_n(&measuring, false, __ATOMIC_RELAXED);
+	elapsed = bench_now_ns() - start;
+
+	if (server)
+		sys_after = proc_syscalls(io_fd);
+
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+	memset(&latency, 0, sizeof(latency));
+	for (i = 0; i < nworkers; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+
+		for (b = 0; b < ULOOP_HIST_BUCKETS; b++)
+			latency.buckets[b] += w->latency.buckets[b];
+		latency.count += w->latency.count;
+		latency.sum += w->latency.sum;
+		if (w->latency.max > latency.max)
+			latency.max = w->latency.max;
+		requests += w->requests;
+	}
+
+	bench_begin("echo_load");
+	bench_result_begin();
+	bench_field_int("connections", nconns);
+	bench_field_int("connected", connected);
+	bench_field_int("failed", failed);
+	bench_field_int("loops", nworkers);
+	bench_field_int("msg_size", msg_size);
+	bench_field_double("duration_s", elapsed / 1e9);
+	bench_field_int("requests", requests);
+	bench_field_double("rps", requests / (elapsed / 1e9));
+	bench_field_int("latency_p50_ns", uloop_histogram_percentile(&latency, 50));
+	bench_field_int("latency_p99_ns", uloop_histogram_percentile(&latency, 99));
+	bench_field_int("latency_p999_ns", uloop_histogram_percentile(&latency, 99.9));
+	bench_field_int("latency_max_ns", latency.max);
+	if (rss_before >= 0 && rss_after >= 0 && connected)
+		bench_field_double("rss_per_conn", (rss_after - rss_before) * 1024.0 / connected);
+	if (sys_before >= 0 && sys_after >= 0 && requests)
+		bench_field_double("rw_syscalls_per_req", (double)(sys_after - sys_before) / requests);
+	bench_result_end();
+	bench_end();
+
+	for (i = 0; i < nworkers; i++) {
+		struct worker *w = &workers[i];
+
+		for (b = 0; b < w->opened; b++) {
+			if (w->clients[b].fd.fd >= 0)
+				client_close(&w->clients[b], false);
+		}
+		uloop_delete(&w->loop);
+		free(w->clients);
+	}
+	free(workers);
+
+	if (status_fd >= 0)
+		close(status_fd);
+	if (io_fd >= 0)
+		close(io_fd);
+
+	return 0;
+}
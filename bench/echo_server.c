@@ -0,0 +1,184 @@
+/*
+ * echo_server - TCP echo server on usock, ustream_fd and uloop
+ *
+ * Every loop of a uloop_group accepts its own share of the connections on
+ * a SO_REUSEPORT listener per port and echoes everything it reads. Reading
+ * stops while more than HIGH_WATER bytes wait to be written back. Meant to
+ * be driven by echo_load, see "make c10k". -b sets the per wakeup read
+ * budget of every connection, -m gives every loop a ustream_pool for the
+ * connection buffers (-m 2: on hugepages).
+ */
+#include <sys/resource.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ustream.h"
+#include "ustream_pool.h"
+#include "uloop_group.h"
+
+#define HIGH_WATER	(64 * 1024)
+#define LOW_WATER	(16 * 1024)
+
+static int read_budget;
+static int use_pool;
+
+struct echo_conn {
+	struct ustream_fd s;
+};
+
+static void echo_notify_read(struct ustream *s, int bytes)
+{
+	char *buf;
+	int len;
+
+	while ((buf = ustream_get_read_buf(s, &len))) {
+		ustream_write(s, buf, len, false);
+		ustream_consume(s, len);
+	}
+
+	if (s->w.data_bytes > HIGH_WATER)
+		ustream_set_read_blocked(s, true);
+}
+
+static void echo_notify_write(struct ustream *s, int bytes)
+{
+	if (ustream_read_blocked(s) && s->w.data_bytes < LOW_WATER)
+		ustream_set_read_blocked(s, false);
+}
+
+static void echo_notify_state(struct ustream *s)
+{
+	struct echo_conn *c = container_of(s, struct echo_conn, s.stream);
+
+	/* on eof, let the pending echo go out first */
+	if (!s->write_error && s->w.data_bytes)
+		return;
+
+	ustream_free(s);
+	close(c->s.fd.fd);
+	free(c);
+}
+
+static void echo_accept(struct uloop_listener *l, int fd)
+{
+	struct echo_conn *c = calloc(1, sizeof(*c));
+
+	if (!c) {
+		close(fd);
+		return;
+	}
+
+	/* the pool is made on the loop thread, before its first stream */
+	if (use_pool && !l->loop->buf_pool)
+		uloop_set_buffer_pool(l->loop, ustream_pool_new(use_pool > 1));
+
+	c->s.stream.notify_read = echo_notify_read;
+	c->s.stream.notify_write = echo_notify_write;
+	c->s.stream.notify_state = echo_notify_state;
+	c->s.read_budget = read_budget;
+	ustream_fd_init(&c->s, l->loop, fd);
+}
+
+static void raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+static void noop_handler(int signo)
+{
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	int port = 7777, nports = 1, nloops = 1;
+	struct uloop_listener *ls;
+	struct uloop_group *g;
+	struct sigaction sa;
+	sigset_t set;
+	char service[16];
+	int ch, i, j, signo;
+
+	while ((ch = getopt(argc, argv, "l:p:n:t:b:m:")) != -1) {
+		switch (ch) {
+		case 'l':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'n':
+			nports = atoi(optarg);
+			break;
+		case 't':
+			nloops = atoi(optarg);
+			break;
+		case 'b':
+			read_budget = atoi(optarg);
+			break;
+		case 'm':
+			use_pool = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-l host] [-p port] [-n ports] [-t loops] "
+				"[-b read budget] [-m pool]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (nports <= 0 || nloops <= 0)
+		return 1;
+
+	raise_nofile();
+
+	/*
+	 * SIGINT and SIGTERM are taken with sigwait() below. with a handler
+	 * installed uloop_run() leaves them alone, and blocking them before
+	 * the group starts keeps them away from the loop threads.
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = noop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	g = uloop_group_new(nloops, NULL);
+	ls = calloc(nports * nloops, sizeof(*ls));
+	if (!g || !ls)
+		return 1;
+
+	for (i = 0; i < nports; i++) {
+		for (j = 0; j < nloops; j++)
+			ls[i * nloops + j].cb = echo_accept;
+
+		snprintf(service, sizeof(service), "%d", port + i);
+		if (uloop_group_listen(g, ls + i * nloops, USOCK_TCP | USOCK_NUMERIC,
+				       host, service, false) < 0) {
+			perror("uloop_group_listen");
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "echo_server: %s:%d-%d, %d loops\n", host, port, port + nports - 1, nloops);
+	sigwait(&set, &signo);
+
+	/* connections still open and their pools are dropped with the process */
+	uloop_group_stop(g);
+	for (i = 0; i < nports * nloops; i++)
+		uloop_listener_remove(ls[i].loop, &ls[i]);
+	uloop_group_delete(&g);
+	free(ls);
+
+	return 0;
+}
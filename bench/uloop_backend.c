@@ -0,0 +1,136 @@
+/*
+ * uloop_backend - compare the uloop polling backends
+ *
+ * Every round writes a byte into each of n socket pairs. The read callback
+ * consumes it and asks for write readiness, the write callback drops the
+ * write interest again, so each fd costs two events and two interest
+ * changes per round.
+ */
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "uloop.h"
+#include "bench.h"
+
+struct bench_fd {
+	struct uloop_fd fd;
+	struct uloop *loop;
+	int peer;
+};
+
+static int pending;
+
+static void bench_fd_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct bench_fd *b = container_of(u, struct bench_fd, fd);
+	char c;
+
+	if (events & ULOOP_READ) {
+		while (read(u->fd, &c, 1) > 0)
+			;
+		uloop_add_fd(b->loop, u, ULOOP_READ | ULOOP_WRITE);
+	} else if (events & ULOOP_WRITE) {
+		uloop_add_fd(b->loop, u, ULOOP_READ);
+		pending--;
+	}
+}
+
+static int run(enum uloop_backend_type type, int nfds, int rounds)
+{
+	struct uloop_options opts = {
+		.max_events = 256,
+		.drain_events = true,
+		.backend = type,
+	};
+	struct bench_fd *fds;
+	struct uloop *loop;
+	int64_t start, elapsed;
+	int i, r, sv[2];
+
+	loop = uloop_new_options(&opts);
+	fds = calloc(nfds, sizeof(*fds));
+	if (!loop || !fds)
+		return -1;
+
+	if (type == ULOOP_BACKEND_IO_URING &&
+	    strcmp(uloop_backend_name(loop), "io_uring")) {
+		fprintf(stderr, "io_uring backend not available\n");
+		uloop_delete(&loop);
+		free(fds);
+		return 0;
+	}
+
+	for (i = 0; i < nfds; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			perror("socketpair");
+			return -1;
+		}
+		fds[i].fd.fd = sv[0];
+		fds[i].fd.cb = bench_fd_cb;
+		fds[i].loop = loop;
+		fds[i].peer = sv[1];
+		uloop_add_fd(loop, &fds[i].fd, ULOOP_READ);
+	}
+
+	start = bench_now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < nfds; i++) {
+			if (write(fds[i].peer, "x", 1) != 1)
+				return -1;
+		}
+
+		pending = nfds;
+		while (pending > 0)
+			uloop_process_events(loop);
+	}
+	elapsed = bench_now_ns() - start;
+
+	bench_result_begin();
+	bench_field_str("backend", uloop_backend_name(loop));
+	bench_field_int("fds", nfds);
+	bench_field_int("rounds", rounds);
+	bench_field_double("usec_per_round", elapsed / 1e3 / rounds);
+	bench_field_double("events_per_sec", 2.0 * nfds * rounds / (elapsed / 1e9));
+	bench_result_end();
+
+	for (i = 0; i < nfds; i++) {
+		uloop_remove_fd(loop, &fds[i].fd);
+		close(fds[i].fd.fd);
+		close(fds[i].peer);
+	}
+	uloop_delete(&loop);
+	free(fds);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int nfds = 512, rounds = 1000;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:r:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nfds = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n fds] [-r rounds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	bench_begin("uloop_backend");
+	if (run(ULOOP_BACKEND_EPOLL, nfds, rounds) < 0 ||
+	    run(ULOOP_BACKEND_IO_URING, nfds, rounds) < 0)
+		return 1;
+	bench_end();
+
+	return 0;
+}
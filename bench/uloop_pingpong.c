@@ -0,0 +1,155 @@
+/*
+ * uloop_pingpong - round trip latency through uloop_fd
+ *
+ * A byte bounces between the two ends of a socketpair, both ends are
+ * registered with the same loop, so every round trip is two wakeups, two
+ * reads and two writes. The time of every round trip is recorded to get
+ * the latency distribution, not only the mean.
+ */
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "uloop.h"
+#include "bench.h"
+
+struct pingpong {
+	struct uloop_fd ping, pong;
+	int64_t start;
+	int64_t *samples;
+	int warmup;
+	int rounds;
+	int done;
+};
+
+static void pong_cb(struct uloop_fd *u, unsigned int events)
+{
+	char c;
+
+	if (read(u->fd, &c, 1) == 1 && write(u->fd, &c, 1) != 1)
+		perror("write");
+}
+
+static void ping_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct pingpong *p = container_of(u, struct pingpong, ping);
+	int64_t now;
+	char c;
+
+	if (read(u->fd, &c, 1) != 1)
+		return;
+
+	now = bench_now_ns();
+	if (p->warmup > 0)
+		p->warmup--;
+	else
+		p->samples[p->done++] = now - p->start;
+
+	if (p->done == p->rounds)
+		return;
+
+	p->start = bench_now_ns();
+	if (write(u->fd, "x", 1) != 1)
+		perror("write");
+}
+
+static int run(enum uloop_backend_type type, int rounds)
+{
+	struct uloop_options opts = {
+		.backend = type,
+	};
+	struct pingpong p;
+	struct uloop *loop;
+	int64_t sum = 0;
+	int i, sv[2];
+
+	loop = uloop_new_options(&opts);
+	if (!loop)
+		return -1;
+
+	if (type == ULOOP_BACKEND_IO_URING &&
+	    strcmp(uloop_backend_name(loop), "io_uring")) {
+		fprintf(stderr, "io_uring backend not available\n");
+		uloop_delete(&loop);
+		return 0;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+		perror("socketpair");
+		uloop_delete(&loop);
+		return -1;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.samples = calloc(rounds, sizeof(*p.samples));
+	p.warmup = rounds / 10;
+	p.rounds = rounds;
+	p.ping.fd = sv[0];
+	p.ping.cb = ping_cb;
+	p.pong.fd = sv[1];
+	p.pong.cb = pong_cb;
+	uloop_add_fd(loop, &p.ping, ULOOP_READ);
+	uloop_add_fd(loop, &p.pong, ULOOP_READ);
+
+	p.start = bench_now_ns();
+	if (write(sv[0], "x", 1) != 1) {
+		perror("write");
+		return -1;
+	}
+
+	while (p.done < rounds)
+		uloop_process_events(loop);
+
+	for (i = 0; i < rounds; i++)
+		sum += p.samples[i];
+	bench_sort(p.samples, rounds);
+
+	bench_result_begin();
+	bench_field_str("backend", uloop_backend_name(loop));
+	bench_field_int("rounds", rounds);
+	bench_field_double("rtt_mean_ns", (double)sum / rounds);
+	bench_field_int("rtt_p50_ns", bench_percentile(p.samples, rounds, 50));
+	bench_field_int("rtt_p99_ns", bench_percentile(p.samples, rounds, 99));
+	bench_field_int("rtt_p999_ns", bench_percentile(p.samples, rounds, 99.9));
+	bench_field_int("rtt_max_ns", p.samples[rounds - 1]);
+	bench_result_end();
+
+	uloop_remove_fd(loop, &p.ping);
+	uloop_remove_fd(loop, &p.pong);
+	close(sv[0]);
+	close(sv[1]);
+	uloop_delete(&loop);
+	free(p.samples);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = 100000;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "r:")) != -1) {
+		switch (ch) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r rounds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (rounds <= 0)
+		return 1;
+
+	bench_begin("uloop_pingpong");
+	if (run(ULOOP_BACKEND_EPOLL, rounds) < 0 ||
+	    run(ULOOP_BACKEND_IO_URING, rounds) < 0)
+		return 1;
+	bench_end();
+
+	return 0;
+}
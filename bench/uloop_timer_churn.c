@@ -0,0 +1,110 @@
+/*
+ * uloop_timer_churn - cost of adding, cancelling and firing timeouts
+ *
+ * For every size n the benchmark adds n timeouts with random deadlines
+ * between 1 ms and one hour, so all levels of the timer wheel are used,
+ * then cancels every other one and re-arms them. Firing is measured with
+ * n timeouts that are all due, which is the dispatch cost alone without
+ * the time spent waiting for the deadlines.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "uloop.h"
+#include "bench.h"
+
+static struct uloop *loop;
+static int fired, expected;
+
+static void timer_cb(struct uloop_timeout *t)
+{
+	/* nothing else is pending, the loop would block after the last one */
+	if (++fired == expected)
+		loop->cancelled = true;
+}
+
+static int run(int n)
+{
+	struct uloop_timeout *timers;
+	int64_t start, add_ns, cancel_ns, readd_ns, fire_ns;
+	int i, half = 0;
+
+	loop = uloop_new();
+	timers = calloc(n, sizeof(*timers));
+	if (!loop || !timers)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		timers[i].cb = timer_cb;
+
+	srandom(n);
+
+	start = bench_now_ns();
+	for (i = 0; i < n; i++)
+		uloop_add_timeout_ms(loop, &timers[i], 1 + random() % 3600000);
+	add_ns = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	for (i = 0; i < n; i += 2, half++)
+		uloop_remove_timeout(loop, &timers[i]);
+	cancel_ns = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	for (i = 0; i < n; i += 2)
+		uloop_add_timeout_ms(loop, &timers[i], 1 + random() % 3600000);
+	readd_ns = bench_now_ns() - start;
+
+	for (i = 0; i < n; i++)
+		uloop_remove_timeout(loop, &timers[i]);
+
+	/* uloop_now() only moves on in the loop, so these are all due at once */
+	for (i = 0; i < n; i++)
+		uloop_add_timeout_ms(loop, &timers[i], 0);
+
+	fired = 0;
+	expected = n;
+	start = bench_now_ns();
+	while (fired < n)
+		uloop_process_events(loop);
+	fire_ns = bench_now_ns() - start;
+
+	bench_result_begin();
+	bench_field_int("timers", n);
+	bench_field_double("add_ns", (double)add_ns / n);
+	bench_field_double("cancel_ns", (double)cancel_ns / half);
+	bench_field_double("readd_ns", (double)readd_ns / half);
+	bench_field_double("fire_ns", (double)fire_ns / n);
+	bench_result_end();
+
+	uloop_delete(&loop);
+	free(timers);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int max = 1000000;
+	int ch, n;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			max = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n max timers]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	bench_begin("uloop_timer_churn");
+	for (n = 1000; n <= max; n *= 10) {
+		if (run(n) < 0)
+			return 1;
+	}
+	bench_end();
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * ustream_buffer - throughput of the ustream write buffering
+ *
+ * The stream's write callback accepts nothing, so everything handed to
+ * ustream_write() and ustream_printf() ends up in the write buffers. After
+ * every batch the buffers are drained by letting the callback accept all
+ * data, which is what a socket that became writable again does. The churn
+ * runs set up and tear down streams like short lived connections, with
+ * and without a ustream_pool on the loop.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ustream.h"
+#include "ustream_pool.h"
+#include "bench.h"
+
+#define BATCH		(1 << 20)
+
+static bool sink_open;
+
+static int sink_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	return sink_open ? len : 0;
+}
+
+static void sink_init(struct ustream *s, struct uloop *loop)
+{
+	memset(s, 0, sizeof(*s));
+	s->write = sink_write;
+	ustream_init_defaults(s);
+	s->loop = loop;
+	sink_open = false;
+}
+
+static void sink_drain(struct ustream *s)
+{
+	sink_open = true;
+	ustream_write_pending(s);
+	sink_open = false;
+}
+
+static void run_write(struct uloop *loop, int size, long long total)
+{
+	struct ustream s;
+	char *buf = malloc(size);
+	long long done = 0, batch;
+	int64_t start, elapsed;
+
+	memset(buf, 'x', size);
+	sink_init(&s, loop);
+
+	start = bench_now_ns();
+	while (done < total) {
+		for (batch = 0; batch < BATCH && done < total; batch += size, done += size)
+			ustream_write(&s, buf, size, false);
+		sink_drain(&s);
+	}
+	elapsed = bench_now_ns() - start;
+
+	bench_result_begin();
+	bench_field_str("op", "write");
+	bench_field_int("size", size);
+	bench_field_int("bytes", done);
+	bench_field_double("mb_per_sec", done / (double)(1 << 20) / (elapsed / 1e9));
+	bench_field_double("ns_per_op", (double)elapsed / (done / size));
+	bench_result_end();
+
+	ustream_free(&s);
+	free(buf);
+}
+
+static void run_printf(struct uloop *loop, long long ops)
+{
+	struct ustream s;
+	long long i, bytes = 0;
+	int64_t start, elapsed;
+
+	sink_init(&s, loop);
+
+	start = bench_now_ns();
+	for (i = 0; i < ops; i++) {
+		bytes += ustream_printf(&s, "%lld %s %d\n", i, "GET /index.html", 200);
+		if (s.w.data_bytes >= BATCH)
+			sink_drain(&s);
+	}
+	sink_drain(&s);
+	elapsed = bench_now_ns() - start;
+
+	bench_result_begin();
+	bench_field_str("op", "printf");
+	bench_field_int("ops", ops);
+	bench_field_int("bytes", bytes);
+	bench_field_double("mb_per_sec", bytes / (double)(1 << 20) / (elapsed / 1e9));
+	bench_field_double("ns_per_op", (double)elapsed / ops);
+	bench_result_end();
+
+	ustream_free(&s);
+}
+
+#define CHURN_STREAMS	256
+
+static void run_churn(struct uloop *loop, long long ops, bool pooled)
+{
+	static struct ustream streams[CHURN_STREAMS];
+	struct ustream_pool *pool = NULL;
+	struct ustream_pool_stats st;
+	char msg[1024], *buf;
+	long long i;
+	int64_t start, elapsed;
+	int len;
+
+	memset(msg, 'x', sizeof(msg));
+	if (pooled) {
+		pool = ustream_pool_new(false);
+		uloop_set_buffer_pool(loop, pool);
+	}
+
+	/* every stream gets a read buffer and two write buffers, then goes */
+	start = bench_now_ns();
+	for (i = 0; i < ops; i += CHURN_STREAMS) {
+		struct ustream *s;
+
+		for (s = streams; s < streams + CHURN_STREAMS; s++) {
+			sink_init(s, loop);
+			buf = ustream_reserve(s, 64, &len);
+			if (buf)
+				ustream_fill_read(s, 64);
+			ustream_write(s, msg, sizeof(msg), false);
+		}
+		for (s = streams; s < streams + CHURN_STREAMS; s++)
+			ustream_free(s);
+	}
+	elapsed = bench_now_ns() - start;
+
+	bench_result_begin();
+	bench_field_str("op", "churn");
+	bench_field_int("pool", pooled);
+	bench_field_int("streams", i);
+	bench_field_double("ns_per_stream", (double)elapsed / i);
+	if (pool) {
+		ustream_pool_get_stats(pool, &st);
+		bench_field_double("hit_rate", st.allocs ? (double)st.hits / st.allocs : 0);
+		bench_field_int("mapped", st.mapped);
+		bench_field_int("slabs", st.slabs);
+	}
+	bench_result_end();
+
+	uloop_set_buffer_pool(loop, NULL);
+	ustream_pool_delete(&pool);
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 16, 256, 4096, 65536 };
+	long long total = 256LL << 20;
+	struct uloop *loop;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "m:")) != -1) {
+		switch (ch) {
+		case 'm':
+			total = atoll(optarg) << 20;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m megabytes]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* the stream needs a loop for its state change notifications */
+	loop = uloop_new();
+	if (!loop)
+		return 1;
+
+	bench_begin("ustream_buffer");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		run_write(loop, sizes[i], total);
+	run_printf(loop, total / 32);
+	run_churn(loop, total / 256, false);
+	run_churn(loop, total / 256, true);
+	bench_end();
+
+	uloop_delete(&loop);
+
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * ustream_throughput - bulk transfer over n concurrent ustream_fd pairs
+ *
+ * Every connection is a socketpair with a ustream_fd on each end. The
+ * writer keeps up to HIGH_WATER bytes queued with ustream_write() and
+ * refills from notify_write, the reader consumes everything from
+ * notify_read. Both ends run on one loop, so the result is the cost of
+ * the ustream and uloop machinery per byte, not of the network.
+ */
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ustream.h"
+#include "bench.h"
+
+#define CHUNK		16384
+#define HIGH_WATER	(4 * CHUNK)
+
+struct conn {
+	struct ustream_fd wr, rd;
+	long long sent, received, total;
+};
+
+static char chunk[CHUNK];
+static int conns_done;
+
+static void conn_fill(struct conn *c)
+{
+	struct ustream *s = &c->wr.stream;
+	int len, wr;
+
+	while (c->sent < c->total && s->w.data_bytes < HIGH_WATER && !s->write_error) {
+		len = c->total - c->sent < CHUNK ? c->total - c->sent : CHUNK;
+		wr = ustream_write(s, chunk, len, false);
+		if (wr <= 0)
+			break;
+		c->sent += wr;
+	}
+}
+
+static void conn_notify_write(struct ustream *s, int bytes)
+{
+	struct conn *c = container_of(s, struct conn, wr.stream);
+
+	conn_fill(c);
+}
+
+static void conn_notify_read(struct ustream *s, int bytes)
+{
+	struct conn *c = container_of(s, struct conn, rd.stream);
+	int len;
+
+	while (ustream_get_read_buf(s, &len)) {
+		ustream_consume(s, len);
+		c->received += len;
+	}
+
+	if (c->received == c->total)
+		conns_done++;
+}
+
+static int run(int nconns, long long total)
+{
+	struct uloop *loop;
+	struct conn *conns;
+	int64_t start, elapsed;
+	int i, sv[2];
+
+	loop = uloop_new();
+	conns = calloc(nconns, sizeof(*conns));
+	if (!loop || !conns)
+		return -1;
+
+	for (i = 0; i < nconns; i++) {
+		struct conn *c = &conns[i];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+			perror("socketpair");
+			return -1;
+		}
+
+		c->total = total / nconns;
+		c->wr.stream.notify_write = conn_notify_write;
+		ustream_fd_init(&c->wr, loop, sv[0]);
+		c->rd.stream.notify_read = conn_notify_read;
+		ustream_fd_init(&c->rd, loop, sv[1]);
+	}
+
+	conns_done = 0;
+	start = bench_now_ns();
+	for (i = 0; i < nconns; i++)
+		conn_fill(&conns[i]);
+
+	while (conns_done < nconns)
+		uloop_process_events(loop);
+	elapsed = bench_now_ns() - start;
+
+	bench_result_begin();
+	bench_field_int("connections", nconns);
+	bench_field_int("bytes", total / nconns * nconns);
+	bench_field_double("elapsed_ms", elapsed / 1e6);
+	bench_field_double("mb_per_sec", (double)(total / nconns * nconns) / (1 << 20) / (elapsed / 1e9));
+	bench_result_end();
+
+	for (i = 0; i < nconns; i++) {
+		ustream_free(&conns[i].wr.stream);
+		ustream_free(&conns[i].rd.stream);
+		close(conns[i].wr.fd.fd);
+		close(conns[i].rd.fd.fd);
+	}
+	uloop_delete(&loop);
+	free(conns);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const int nconns[] = { 1, 16, 256 };
+	long long total = 256LL << 20;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "m:")) != -1) {
+		switch (ch) {
+		case 'm':
+			total = atoll(optarg) << 20;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m megabytes]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	memset(chunk, 'x', sizeof(chunk));
+
+	bench_begin("ustream_throughput");
+	for (i = 0; i < sizeof(nconns) / sizeof(nconns[0]); i++) {
+		if (run(nconns[i], total) < 0)
+			return 1;
+	}
+	bench_end();
+
+	return 0;
+}
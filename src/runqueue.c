@@ -21,9 +21,9 @@
 #include "runqueue.h"
 
 static void
-__runqueue_empty_cb(struct uloop_timeout *timeout)
+__runqueue_empty_cb(struct uloop_defer *defer)
 {
-	struct runqueue *q = container_of(timeout, struct runqueue, timeout);
+	struct runqueue *q = container_of(defer, struct runqueue, defer);
 
 	q->empty_cb(q);
 }
@@ -35,9 +35,9 @@ void runqueue_init(struct runqueue *q, struct uloop *loop)
 	q->loop = loop; 
 }
 
-static void __runqueue_start_next(struct uloop_timeout *timeout)
+static void __runqueue_start_next(struct uloop_defer *defer)
 {
-	struct runqueue *q = container_of(timeout, struct runqueue, timeout);
+	struct runqueue *q = container_of(defer, struct runqueue, defer);
 	struct runqueue_task *t;
 
 	do {
@@ -65,8 +65,8 @@ static void __runqueue_start_next(struct uloop_timeout *timeout)
 	    list_empty(&q->tasks_inactive.list)) {
 		q->empty = true;
 		if (q->empty_cb) {
-			q->timeout.cb = __runqueue_empty_cb;
-			uloop_timeout_set(&q->timeout, 1);
+			q->defer.cb = __runqueue_empty_cb;
+			uloop_add_defer(q->loop, &q->defer);
 		}
 	}
 }
@@ -76,8 +76,8 @@ static void runqueue_start_next(struct runqueue *q)
 	if (q->empty)
 		return;
 
-	q->timeout.cb = __runqueue_start_next;
-	uloop_timeout_set(&q->timeout, 1);
+	q->defer.cb = __runqueue_start_next;
+	uloop_add_defer(q->loop, &q->defer);
 }
 
 static int __runqueue_cancel(void *ctx, struct safe_list *list)
@@ -115,7 +115,7 @@ void runqueue_kill(struct runqueue *q)
 		runqueue_task_kill(t);
 	}
 	runqueue_cancel_pending(q);
-	uloop_timeout_cancel(&q->timeout);
+	uloop_remove_defer(q->loop, &q->defer);
 }
 
 void runqueue_task_cancel(struct runqueue_task *t, int type)
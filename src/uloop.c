@@ -27,9 +27,14 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "uloop.h"
 #include "ustream.h"
+#include "uloop_work.h"
+#include "uloop_stats.h"
+#include "uloop_watchdog.h"
 
 //#include "utils.h"
 
@@ -37,24 +42,37 @@
 #include <sys/epoll.h>
 #endif
 #include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifdef ULOOP_STATS
+#define ULOOP_STATS_NOW()		clock_monotonic_ns()
+#define ULOOP_STATS_RECORD(self, hist, v)	_uloop_histogram_record(&(self)->stats->hist, (v))
+#else
+#define ULOOP_STATS_NOW()		0
+#define ULOOP_STATS_RECORD(self, hist, v)	do { (void)(v); } while (0)
+#endif
 
-void uloop_init(struct uloop *self){
-	self->fd_stack = NULL; 
-	INIT_LIST_HEAD(&self->timeouts); 
-	INIT_LIST_HEAD(&self->processes); 
-	self->cancelled = false; 
-	self->do_sigchld = false; 
-	self->cur_fd = self->cur_nfds = 0; 
+/* pidfd_open() is 434 on all architectures, older headers may lack it */
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
-	self->recursive_calls = 0; 
-	self->poll_fd = epoll_create(32);
-	fcntl(self->poll_fd, F_SETFD, fcntl(self->poll_fd, F_GETFD) | FD_CLOEXEC);
-}
+static void _uloop_timer_wheel_init(struct uloop_timer_wheel *w){
+	struct timeval tv;
+	int level, slot;
 
-struct uloop *uloop_new(void){
-	struct uloop *self = malloc(sizeof(struct uloop)); 
-	uloop_init(self); 
-	return self; 
+	for (level = 0; level < ULOOP_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < ULOOP_WHEEL_SIZE; slot++)
+			INIT_LIST_HEAD(&w->slots[level][slot]);
+		w->pending[level] = 0;
+	}
+
+	clock_monotonic(&tv);
+	w->tick = _tv_ms(&tv);
 }
 
 /**
@@ -64,9 +82,36 @@ struct uloop *uloop_new(void){
 #define EPOLLRDHUP 0x2000
 #endif
 
-static int _uloop_register_poll_fd(struct uloop *self, struct uloop_fd *fd, unsigned int flags){
+static int _uloop_epoll_init(struct uloop *self){
+	self->events = calloc(self->max_events, sizeof(*self->events)); 
+	if (!self->events)
+		return -1; 
+
+	self->poll_fd = epoll_create(32);
+	if (self->poll_fd < 0) {
+		free(self->events); 
+		self->events = NULL; 
+		return -1; 
+	}
+
+	fcntl(self->poll_fd, F_SETFD, fcntl(self->poll_fd, F_GETFD) | FD_CLOEXEC);
+	return 0; 
+}
+
+static void _uloop_epoll_destroy(struct uloop *self){
+	close(self->poll_fd);
+	free(self->events);
+	self->events = NULL;
+	free(self->fd_changes);
+	self->fd_changes = NULL;
+	self->fd_nchanges = self->fd_changes_size = 0;
+}
+
+/* interest bits that end up in the epoll_event */
+#define ULOOP_EPOLL_FLAGS	(ULOOP_READ | ULOOP_WRITE | ULOOP_EDGE_TRIGGER)
+
+static int _uloop_epoll_ctl(struct uloop *self, int op, struct uloop_fd *fd, unsigned int flags){
 	struct epoll_event ev;
-	int op = fd->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
 
 	memset(&ev, 0, sizeof(struct epoll_event));
 
@@ -79,18 +124,131 @@ static int _uloop_register_poll_fd(struct uloop *self, struct uloop_fd *fd, unsi
 	if (flags & ULOOP_EDGE_TRIGGER)
 		ev.events |= EPOLLET;
 
-	ev.data.fd = fd->fd;
 	ev.data.ptr = fd;
-	fd->flags = flags;
 
 	return epoll_ctl(self->poll_fd, op, fd->fd, &ev);
 }
 
-static int _uloop_fetch_events(struct uloop *self, int timeout)
+/*
+ * Passes the queued interest changes to the kernel. A fd whose flags were
+ * changed back in the meantime costs nothing, one that changed several
+ * times costs a single epoll_ctl(). Edge triggered fds are re-armed by the
+ * MOD before the wait, just as they were when it was issued right away, so
+ * one that had read or write interest removed and restored still gets its
+ * MOD: without it data that is already pending would never be reported.
+ */
+static void _uloop_epoll_flush(struct uloop *self){
+	struct uloop_fd_change *c;
+	int i;
+
+	for (i = 0; i < self->fd_nchanges; i++) {
+		c = &self->fd_changes[i];
+		if (!c->fd)
+			continue;
+
+		c->fd->flags &= ~ULOOP_CTL_QUEUED;
+		if (!c->rearm && (c->fd->flags & ULOOP_EPOLL_FLAGS) == c->flags)
+			continue;
+
+		_uloop_epoll_ctl(self, EPOLL_CTL_MOD, c->fd, c->fd->flags);
+	}
+
+	self->fd_nchanges = 0;
+}
+
+static int _uloop_epoll_queue_change(struct uloop *self, struct uloop_fd *fd, bool rearm){
+	struct uloop_fd_change *changes;
+	int size;
+
+	if (self->fd_nchanges == self->fd_changes_size) {
+		size = self->fd_changes_size ? self->fd_changes_size * 2 : 64;
+		changes = realloc(self->fd_changes, size * sizeof(*changes));
+		if (!changes)
+			return -1;
+
+		self->fd_changes = changes;
+		self->fd_changes_size = size;
+	}
+
+	self->fd_changes[self->fd_nchanges].fd = fd;
+	self->fd_changes[self->fd_nchanges].flags = fd->flags & ULOOP_EPOLL_FLAGS;
+	self->fd_changes[self->fd_nchanges].rearm = rearm;
+	self->fd_nchanges++;
+
+	return 0;
+}
+
+static void _uloop_epoll_queue_rearm(struct uloop *self, struct uloop_fd *fd){
+	int i;
+
+	for (i = self->fd_nchanges - 1; i >= 0; i--) {
+		if (self->fd_changes[i].fd == fd) {
+			self->fd_changes[i].rearm = true;
+			return;
+		}
+	}
+}
+
+/*
+ * Adding a fd goes to the kernel right away so that errors (e.g. EPERM for
+ * regular files) still reach the caller. Modifications are only queued:
+ * flipping write interest on and off within one iteration, or setting the
+ * flags a fd already has, makes no syscall at all. The exception are edge
+ * triggered fds getting read or write interest back, see _uloop_epoll_flush().
+ */
+static int _uloop_epoll_register_fd(struct uloop *self, struct uloop_fd *fd, unsigned int flags){
+	unsigned int queued = fd->flags & ULOOP_CTL_QUEUED;
+	bool rearm = (flags & ULOOP_EDGE_TRIGGER) && (flags & ~fd->flags & ULOOP_EVENT_MASK);
+
+	if (!fd->registered) {
+		fd->flags = flags;
+		return _uloop_epoll_ctl(self, EPOLL_CTL_ADD, fd, flags);
+	}
+
+	if (queued) {
+		fd->flags = flags | queued;
+		if (rearm)
+			_uloop_epoll_queue_rearm(self, fd);
+		return 0;
+	}
+
+	if ((fd->flags & ULOOP_EPOLL_FLAGS) == (flags & ULOOP_EPOLL_FLAGS)) {
+		fd->flags = flags;
+		return 0;
+	}
+
+	if (_uloop_epoll_queue_change(self, fd, rearm) < 0) {
+		fd->flags = flags;
+		return _uloop_epoll_ctl(self, EPOLL_CTL_MOD, fd, flags);
+	}
+
+	fd->flags = flags | ULOOP_CTL_QUEUED;
+	return 0;
+}
+
+static int _uloop_epoll_unregister_fd(struct uloop *self, struct uloop_fd *fd){
+	int i;
+
+	/* the caller may free fd right after this, drop its queued change */
+	if (fd->flags & ULOOP_CTL_QUEUED) {
+		for (i = 0; i < self->fd_nchanges; i++) {
+			if (self->fd_changes[i].fd == fd)
+				self->fd_changes[i].fd = NULL;
+		}
+		fd->flags &= ~ULOOP_CTL_QUEUED;
+	}
+
+	return epoll_ctl(self->poll_fd, EPOLL_CTL_DEL, fd->fd, 0);
+}
+
+static int _uloop_epoll_fetch_events(struct uloop *self, int timeout)
 {
 	int n, nfds;
 
-	nfds = epoll_wait(self->poll_fd, self->events, sizeof(self->events) / sizeof(self->events[0]), timeout);
+	if (self->fd_nchanges)
+		_uloop_epoll_flush(self);
+
+	nfds = epoll_wait(self->poll_fd, self->events, self->max_events, timeout);
 	for (n = 0; n < nfds; ++n) {
 		struct uloop_fd_event *cur = &self->cur_fds[n];
 		struct uloop_fd *u = self->events[n].data.ptr;
@@ -102,6 +260,8 @@ static int _uloop_fetch_events(struct uloop *self, int timeout)
 
 		if (self->events[n].events & (EPOLLERR|EPOLLHUP)) {
 			u->error = true;
+			if (self->events[n].events & EPOLLHUP)
+				u->hangup = true;
 			if (!(u->flags & ULOOP_ERROR_CB))
 				uloop_remove_fd(self, u);
 		}
@@ -126,6 +286,444 @@ static int _uloop_fetch_events(struct uloop *self, int timeout)
 	return nfds;
 }
 
+static const struct uloop_backend uloop_epoll_backend = {
+	.name = "epoll",
+	.init = _uloop_epoll_init,
+	.destroy = _uloop_epoll_destroy,
+	.register_fd = _uloop_epoll_register_fd,
+	.unregister_fd = _uloop_epoll_unregister_fd,
+	.fetch_events = _uloop_epoll_fetch_events,
+};
+
+/* takes all posted tasks off the stack, oldest first */
+static struct uloop_post_task *_uloop_take_posted(struct uloop *self){
+	struct uloop_post_task *task, *next, *list = NULL;
+
+	task = __atomic_exchange_n(&self->posted, NULL, __ATOMIC_ACQUIRE);
+	while (task) {
+		next = task->next;
+		task->next = list;
+		list = task;
+		task = next;
+	}
+
+	return list;
+}
+
+static void _uloop_wakeup_cb(struct uloop_fd *fd, unsigned int events){
+	struct uloop *self = container_of(fd, struct uloop, wakeup);
+	struct uloop_post_task *task, *next;
+	uint64_t val;
+
+	while (read(fd->fd, &val, sizeof(val)) < 0 && errno == EINTR)
+		;
+
+	for (task = _uloop_take_posted(self); task; task = next) {
+		next = task->next;
+		task->cb(task->arg);
+		free(task);
+	}
+}
+
+void uloop_post_task(struct uloop *self, struct uloop_post_task *task){
+	struct uloop_post_task *head;
+	uint64_t one = 1;
+
+	/* task may already be run and freed by the loop once it is pushed */
+	head = __atomic_load_n(&self->posted, __ATOMIC_RELAXED);
+	do {
+		task->next = head;
+	} while (!__atomic_compare_exchange_n(&self->posted, &head, task, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* only the post that finds the stack empty needs to wake up the loop */
+	if (!head) {
+		while (write(self->wakeup.fd, &one, sizeof(one)) < 0 && errno == EINTR)
+			;
+	}
+}
+
+int uloop_post(struct uloop *self, uloop_post_handler cb, void *arg){
+	struct uloop_post_task *task = malloc(sizeof(*task));
+
+	if (!task)
+		return -1;
+
+	task->cb = cb;
+	task->arg = arg;
+	uloop_post_task(self, task);
+
+	return 0;
+}
+
+static void _uloop_signal_cb(struct uloop_fd *fd, unsigned int events){
+	struct uloop *self = container_of(fd, struct uloop, signal_fd);
+	struct signalfd_siginfo info[8];
+	struct uloop_signal *s;
+	struct list_head *p;
+	ssize_t len;
+	int i;
+
+	/*
+	 * a callback may remove any watcher, not only itself, so the next one
+	 * is kept in the loop where uloop_remove_signal() can step over it
+	 */
+	while ((len = read(fd->fd, info, sizeof(info))) > 0) {
+		for (i = 0; i < len / (ssize_t)sizeof(info[0]); i++) {
+			for (p = self->signals.next; p != &self->signals; p = self->signal_next) {
+				s = list_entry(p, struct uloop_signal, list);
+				self->signal_next = p->next;
+				if (s->signo == (int)info[i].ssi_signo)
+					s->cb(s);
+			}
+			self->signal_next = NULL;
+		}
+	}
+}
+
+/* brings the signalfd and the blocked signals in line with the watcher list */
+static int _uloop_update_signals(struct uloop *self){
+	struct uloop_signal *s;
+	sigset_t mask, cur, add, drop;
+	int signo;
+
+	sigemptyset(&mask);
+	list_for_each_entry(s, &self->signals, list)
+		sigaddset(&mask, s->signo);
+
+	/* only signals that were not blocked already are ours to unblock later */
+	sigemptyset(&add);
+	sigemptyset(&drop);
+	pthread_sigmask(SIG_BLOCK, NULL, &cur);
+	for (signo = 1; signo < _NSIG; signo++) {
+		if (sigismember(&mask, signo) == 1) {
+			if (sigismember(&cur, signo) != 1) {
+				sigaddset(&self->signal_blocked, signo);
+				sigaddset(&add, signo);
+			}
+		} else if (sigismember(&self->signal_blocked, signo) == 1) {
+			sigdelset(&self->signal_blocked, signo);
+			sigaddset(&drop, signo);
+		}
+	}
+
+	/* block before the signalfd starts listening, unblock after it stopped */
+	pthread_sigmask(SIG_BLOCK, &add, NULL);
+
+	if (sigisemptyset(&mask)) {
+		if (self->signal_fd.fd >= 0) {
+			uloop_remove_fd(self, &self->signal_fd);
+			close(self->signal_fd.fd);
+			self->signal_fd.fd = -1;
+		}
+	} else if (self->signal_fd.fd < 0) {
+		self->signal_fd.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (self->signal_fd.fd < 0)
+			return -1;
+
+		if (uloop_add_fd(self, &self->signal_fd, ULOOP_READ) < 0) {
+			close(self->signal_fd.fd);
+			self->signal_fd.fd = -1;
+			return -1;
+		}
+	} else if (signalfd(self->signal_fd.fd, &mask, 0) < 0) {
+		return -1;
+	}
+
+	self->signal_mask = mask;
+	pthread_sigmask(SIG_UNBLOCK, &drop, NULL);
+
+	return 0;
+}
+
+int uloop_add_signal(struct uloop *self, struct uloop_signal *s){
+	if (s->pending || s->signo <= 0 || s->signo >= _NSIG)
+		return -1;
+
+	list_add_tail(&s->list, &self->signals);
+	s->loop = self;
+	s->pending = true;
+
+	if (_uloop_update_signals(self) < 0) {
+		list_del(&s->list);
+		s->pending = false;
+		_uloop_update_signals(self);
+		return -1;
+	}
+
+	return 0;
+}
+
+int uloop_remove_signal(struct uloop *self, struct uloop_signal *s){
+	if (!s->pending)
+		return -1;
+
+	if (self->signal_next == &s->list)
+		self->signal_next = s->list.next;
+	list_del(&s->list);
+	s->pending = false;
+
+	return _uloop_update_signals(self);
+}
+
+static void _uloop_cancel_signal_cb(struct uloop_signal *s){
+	s->loop->cancelled = true;
+}
+
+/* signals with a custom handler are left to that handler */
+static void _uloop_cancel_on_signal(struct uloop *self, struct uloop_signal *s, int signo, bool add){
+	struct sigaction sa;
+
+	if (!add) {
+		uloop_remove_signal(self, s);
+		return;
+	}
+
+	sigaction(signo, NULL, &sa);
+	if (sa.sa_handler != SIG_DFL)
+		return;
+
+	s->cb = _uloop_cancel_signal_cb;
+	s->signo = signo;
+	uloop_add_signal(self, s);
+}
+
+/*
+ * Rounds an expiry up to the coarsest power of two boundary that is still
+ * within its slack. Timeouts with overlapping slack windows then tend to
+ * expire on the same boundary and are fired by a single wakeup.
+ */
+static int64_t _uloop_apply_slack(int64_t expires, int64_t slack){
+	int64_t mask;
+
+	if (slack <= 0)
+		return expires;
+
+	mask = ((int64_t)1 << (63 - __builtin_clzll(slack))) - 1;
+	return (expires + mask) & ~mask;
+}
+
+/* points the timerfd at the earliest high resolution timeout */
+static void _uloop_hires_arm(struct uloop *self){
+	struct itimerspec its;
+	int64_t next = 0;
+
+	if (!list_empty(&self->hires_timeouts))
+		next = list_first_entry(&self->hires_timeouts, struct uloop_timeout, list)->expires_ns;
+
+	/* an all-zero it_value disarms the timer */
+	if (next <= 0 && !list_empty(&self->hires_timeouts))
+		next = 1;
+
+	if (next == self->hires_armed)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000000LL;
+	its.it_value.tv_nsec = next % 1000000000LL;
+	timerfd_settime(self->hires_fd.fd, TFD_TIMER_ABSTIME, &its, NULL);
+	self->hires_armed = next;
+}
+
+static void _uloop_hires_cb(struct uloop_fd *fd, unsigned int events){
+	struct uloop *self = container_of(fd, struct uloop, hires_fd);
+	struct uloop_timeout *t, *tmp;
+	struct list_head expired;
+	uint64_t count;
+	int64_t now;
+
+	while (read(fd->fd, &count, sizeof(count)) < 0 && errno == EINTR)
+		;
+
+	/* the timer is one-shot, it is disarmed once it has fired */
+	self->hires_armed = 0;
+
+	/* timeouts re-armed from a callback wait for the next expiry */
+	now = clock_monotonic_ns();
+	INIT_LIST_HEAD(&expired);
+	list_for_each_entry_safe(t, tmp, &self->hires_timeouts, list) {
+		if (t->expires_ns > now)
+			break;
+		list_move_tail(&t->list, &expired);
+	}
+
+	while (!list_empty(&expired)) {
+		struct uloop_watchdog_frame wdf = { 0 };
+		int64_t start = ULOOP_STATS_NOW();
+
+		t = list_first_entry(&expired, struct uloop_timeout, list);
+		ULOOP_STATS_RECORD(self, timer_late_ns, start - t->expires_ns);
+
+		uloop_timeout_cancel(t);
+		if (self->watchdog)
+			_uloop_watchdog_enter(self->watchdog, &wdf, t->cb, t, -1);
+		if (t->cb)
+			t->cb(t);
+		if (self->watchdog)
+			_uloop_watchdog_leave(self->watchdog, &wdf);
+
+		ULOOP_STATS_RECORD(self, callback_ns, ULOOP_STATS_NOW() - start);
+	}
+
+	_uloop_hires_arm(self);
+}
+
+static int _uloop_add_hires_timeout(struct uloop *self, struct uloop_timeout *timeout){
+	struct uloop_timeout *pos;
+
+	timeout->expires_ns = _uloop_apply_slack(timeout->expires_ns, (int64_t)timeout->slack * 1000000);
+
+	if (self->hires_fd.fd < 0) {
+		self->hires_fd.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (self->hires_fd.fd < 0)
+			return -1;
+
+		if (uloop_add_fd(self, &self->hires_fd, ULOOP_READ) < 0) {
+			close(self->hires_fd.fd);
+			self->hires_fd.fd = -1;
+			return -1;
+		}
+	}
+
+	/* pacing timers are usually armed in order, so search from the back */
+	list_for_each_entry_reverse(pos, &self->hires_timeouts, list) {
+		if (pos->expires_ns <= timeout->expires_ns)
+			break;
+	}
+	list_add(&timeout->list, &pos->list);
+	timeout->pending = true;
+
+	/* cancelled timeouts are not tracked, an early wakeup just re-arms */
+	if (!self->hires_armed || timeout->expires_ns < self->hires_armed)
+		_uloop_hires_arm(self);
+
+	return 0;
+}
+
+int uloop_init_options(struct uloop *self, const struct uloop_options *opts){
+	enum uloop_backend_type backend = ULOOP_BACKEND_DEFAULT; 
+
+	self->fd_stack = NULL; 
+	_uloop_timer_wheel_init(&self->timeouts); 
+	INIT_LIST_HEAD(&self->hires_timeouts); 
+	memset(&self->hires_fd, 0, sizeof(self->hires_fd)); 
+	self->hires_fd.cb = _uloop_hires_cb; 
+	self->hires_fd.fd = -1; 
+	self->hires_armed = 0; 
+	INIT_LIST_HEAD(&self->processes); 
+	INIT_LIST_HEAD(&self->deferred); 
+	self->cancelled = false; 
+	self->cur_fd = self->cur_nfds = 0; 
+	self->now = clock_monotonic_ns(); 
+
+	self->max_events = ULOOP_MAX_EVENTS; 
+	self->drain_events = false; 
+	self->busy_poll_max = 0; 
+	self->busy_poll_sock = 0; 
+	if (opts) {
+		if (opts->max_events > 0)
+			self->max_events = opts->max_events; 
+		self->drain_events = opts->drain_events; 
+		backend = opts->backend; 
+		if (opts->busy_poll_us > 0)
+			self->busy_poll_max = (int64_t)opts->busy_poll_us * 1000; 
+		if (opts->busy_poll_sock_us > 0)
+			self->busy_poll_sock = opts->busy_poll_sock_us; 
+	}
+	self->busy_poll_budget = self->busy_poll_max; 
+	self->watchdog = NULL; 
+
+	self->busy_poll_spin_ns = 0; 
+	self->busy_poll_hits = self->busy_poll_misses = 0; 
+
+	self->recursive_calls = 0; 
+	self->backend = NULL; 
+	self->ring = NULL; 
+	self->events = NULL; 
+	self->fd_changes = NULL; 
+	self->fd_nchanges = self->fd_changes_size = 0; 
+	self->poll_fd = -1; 
+	self->cur_fds = calloc(self->max_events, sizeof(*self->cur_fds)); 
+	if (!self->cur_fds)
+		return -1; 
+
+	self->stats = NULL; 
+#ifdef ULOOP_STATS
+	self->stats = calloc(1, sizeof(*self->stats)); 
+	if (!self->stats) {
+		free(self->cur_fds); 
+		self->cur_fds = NULL; 
+		return -1; 
+	}
+#endif
+
+#ifdef USE_IO_URING
+	if (backend == ULOOP_BACKEND_IO_URING && !uloop_io_uring_backend.init(self))
+		self->backend = &uloop_io_uring_backend; 
+#endif
+
+	if (!self->backend) {
+		if (_uloop_epoll_init(self) < 0) {
+			free(self->cur_fds); 
+			self->cur_fds = NULL; 
+			free(self->stats); 
+			self->stats = NULL; 
+			return -1; 
+		}
+		self->backend = &uloop_epoll_backend; 
+	}
+
+	INIT_LIST_HEAD(&self->signals); 
+	self->signal_next = NULL;
+	sigemptyset(&self->signal_mask); 
+	sigemptyset(&self->signal_blocked); 
+	memset(&self->signal_fd, 0, sizeof(self->signal_fd)); 
+	self->signal_fd.cb = _uloop_signal_cb; 
+	self->signal_fd.fd = -1; 
+	memset(&self->sigint, 0, sizeof(self->sigint)); 
+	memset(&self->sigterm, 0, sizeof(self->sigterm)); 
+
+	self->work_pool = NULL; 
+	self->work_pool_owned = false; 
+	self->buf_pool = NULL; 
+
+	self->posted = NULL; 
+	memset(&self->wakeup, 0, sizeof(self->wakeup)); 
+	self->wakeup.cb = _uloop_wakeup_cb; 
+	self->wakeup.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
+	if (self->wakeup.fd < 0 || uloop_add_fd(self, &self->wakeup, ULOOP_READ) < 0) {
+		uloop_destroy(self); 
+		return -1; 
+	}
+
+	if (opts && opts->watchdog_ms > 0 && uloop_watchdog_start(self, opts->watchdog_ms) < 0) {
+		uloop_destroy(self); 
+		return -1; 
+	}
+
+	return 0; 
+}
+
+int uloop_init(struct uloop *self){
+	return uloop_init_options(self, NULL); 
+}
+
+struct uloop *uloop_new_options(const struct uloop_options *opts){
+	struct uloop *self = malloc(sizeof(struct uloop)); 
+	if (!self)
+		return NULL; 
+
+	if (uloop_init_options(self, opts) < 0) {
+		free(self); 
+		return NULL; 
+	}
+	return self; 
+}
+
+struct uloop *uloop_new(void){
+	return uloop_new_options(NULL); 
+}
+
 static bool _uloop_fd_stack_event(struct uloop *self, struct uloop_fd *fd, int events){
 	struct uloop_fd_stack *cur;
 
@@ -151,16 +749,81 @@ static bool _uloop_fd_stack_event(struct uloop *self, struct uloop_fd *fd, int e
 	return false;
 }
 
+/*
+ * Spins on zero timeout waits for up to the current busy poll budget before
+ * blocking. Spins that find events double the budget, spins that come up
+ * empty halve it, so an idle loop quickly goes back to blocking. A blocking
+ * wait that returns within the budget limit restores the full budget since
+ * spinning would have caught that event.
+ */
+static int _uloop_fetch_events(struct uloop *self, int timeout)
+{
+	int64_t budget = self->busy_poll_budget;
+	int64_t start, now;
+	int nfds;
+
+	if (!self->busy_poll_max || !timeout)
+		return self->backend->fetch_events(self, timeout);
+
+	if (timeout > 0 && budget > (int64_t)timeout * 1000000)
+		budget = (int64_t)timeout * 1000000;
+
+	start = now = clock_monotonic_ns();
+	while (now - start < budget) {
+		nfds = self->backend->fetch_events(self, 0);
+		now = clock_monotonic_ns();
+		/* an error (e.g. EINTR) is no hit, leave it to the blocking wait */
+		if (nfds < 0)
+			break;
+		if (nfds > 0) {
+			self->busy_poll_spin_ns += now - start;
+			self->busy_poll_hits++;
+			if (self->busy_poll_budget < self->busy_poll_max / 2)
+				self->busy_poll_budget *= 2;
+			else
+				self->busy_poll_budget = self->busy_poll_max;
+			return nfds;
+		}
+	}
+
+	if (budget > 0) {
+		self->busy_poll_spin_ns += now - start;
+		self->busy_poll_misses++;
+		self->busy_poll_budget /= 2;
+	}
+
+	if (timeout > 0) {
+		timeout -= (now - start) / 1000000;
+		if (timeout < 0)
+			timeout = 0;
+	}
+
+	nfds = self->backend->fetch_events(self, timeout);
+	if (nfds > 0 && clock_monotonic_ns() - now < self->busy_poll_max)
+		self->busy_poll_budget = self->busy_poll_max;
+
+	return nfds;
+}
+
 static void _uloop_run_events(struct uloop *self, int timeout)
 {
 	struct uloop_fd_event *cur;
 	struct uloop_fd *fd;
 
 	if (!self->cur_nfds) {
+		int64_t start = ULOOP_STATS_NOW();
+
 		self->cur_fd = 0;
 		self->cur_nfds = _uloop_fetch_events(self, timeout);
 		if (self->cur_nfds < 0)
 			self->cur_nfds = 0;
+
+		/* the wait may have slept, events are handled as of its end */
+		if (timeout)
+			self->now = clock_monotonic_ns();
+
+		ULOOP_STATS_RECORD(self, sleep_ns, ULOOP_STATS_NOW() - start);
+		ULOOP_STATS_RECORD(self, events, self->cur_nfds);
 	}
 
 	while (self->cur_nfds > 0) {
@@ -185,13 +848,23 @@ static void _uloop_run_events(struct uloop *self, int timeout)
 		stack_cur.fd = fd;
 		self->fd_stack = &stack_cur;
 		do {
+			struct uloop_watchdog_frame wdf = { 0 };
+			int64_t start = ULOOP_STATS_NOW();
+
 			stack_cur.events = 0;
+			if (self->watchdog)
+				_uloop_watchdog_enter(self->watchdog, &wdf, fd->cb, fd, fd->fd);
 			fd->cb(fd, events);
+			if (self->watchdog)
+				_uloop_watchdog_leave(self->watchdog, &wdf);
 			events = stack_cur.events & ULOOP_EVENT_MASK;
+
+			ULOOP_STATS_RECORD(self, callback_ns, ULOOP_STATS_NOW() - start);
 		} while (stack_cur.fd && events);
 		self->fd_stack = stack_cur.next;
 
-		return;
+		if (!self->drain_events)
+			return;
 	}
 }
 
@@ -208,20 +881,25 @@ int uloop_add_fd(struct uloop *self, struct uloop_fd *sock, unsigned int flags){
 		fcntl(sock->fd, F_SETFL, fl);
 	}
 
-	ret = _uloop_register_poll_fd(self, sock, flags);
+	/* fails harmlessly for anything that is not a socket */
+	if (!sock->registered && self->busy_poll_sock)
+		setsockopt(sock->fd, SOL_SOCKET, SO_BUSY_POLL, &self->busy_poll_sock, sizeof(self->busy_poll_sock));
+
+	ret = self->backend->register_fd(self, sock, flags);
 	if (ret < 0)
 		goto out;
 
 	sock->registered = true;
 	sock->eof = false;
 	sock->error = false;
+	sock->hangup = false;
 
 out:
 	return ret;
 }
 
 int uloop_remove_fd(struct uloop *self, struct uloop_fd *fd){
-	int i;
+	int i, ret;
 
 	for (i = 0; i < self->cur_nfds; i++) {
 		if (self->cur_fds[self->cur_fd + i].fd != fd)
@@ -236,8 +914,9 @@ int uloop_remove_fd(struct uloop *self, struct uloop_fd *fd){
 	fd->registered = false;
 	_uloop_fd_stack_event(self, fd, -1);
 	
+	ret = self->backend->unregister_fd(self, fd);
 	fd->flags = 0;
-	return epoll_ctl(self->poll_fd, EPOLL_CTL_DEL, fd->fd, 0);
+	return ret;
 }
 
 void uloop_add_ustream(struct uloop *self, struct ustream *s, bool write){
@@ -252,116 +931,248 @@ void uloop_add_ustream(struct uloop *self, struct ustream *s, bool write){
 	if (write || (buf && s->w.data_bytes && !s->write_error))
 		flags |= ULOOP_WRITE;
 
+	/* MSG_ZEROCOPY completions are reported as EPOLLERR */
+	if (sf->zerocopy)
+		flags |= ULOOP_ERROR_CB;
+
 	uloop_add_fd(self, &sf->fd, flags);
 }
 
-int uloop_add_timeout(struct uloop *self, struct uloop_timeout *timeout){
-	struct uloop_timeout *tmp;
-	struct list_head *h = &self->timeouts;
+static void _uloop_timer_wheel_insert(struct uloop_timer_wheel *w, struct uloop_timeout *t){
+	int64_t range = (int64_t)1 << (ULOOP_WHEEL_LEVELS * ULOOP_WHEEL_BITS);
+	int64_t expires = t->expires;
+	int64_t delta;
+	int level, slot;
 
-	if (timeout->pending)
-		return -1;
+	if (expires < w->tick)
+		expires = w->tick;
+
+	delta = expires - w->tick;
+	if (delta >= range)
+		expires = w->tick + range - 1;
 
-	list_for_each_entry(tmp, &self->timeouts, list) {
-		if (_tv_diff(&tmp->time, &timeout->time) > 0) {
-			h = &tmp->list;
+	for (level = 0; level < ULOOP_WHEEL_LEVELS - 1; level++) {
+		if (delta < ((int64_t)1 << ((level + 1) * ULOOP_WHEEL_BITS)))
 			break;
-		}
 	}
 
-	list_add_tail(&timeout->list, h);
-	timeout->pending = true;
+	slot = (expires >> (level * ULOOP_WHEEL_BITS)) & ULOOP_WHEEL_MASK;
+	if (list_empty(&w->slots[level][slot]) || expires < w->first[level][slot])
+		w->first[level][slot] = expires;
+	list_add_tail(&t->list, &w->slots[level][slot]);
+	w->pending[level] |= (uint64_t)1 << slot;
+}
 
-	return 0;
+static inline uint64_t _uloop_rotr64(uint64_t v, int n){
+	n &= 63;
+	return n ? (v >> n) | (v << (64 - n)) : v;
 }
-int uloop_add_process(struct uloop *self, struct uloop_process *p){
-	struct uloop_process *tmp;
-	struct list_head *h = &self->processes;
 
-	if (p->pending)
-		return -1;
+/*
+ * Returns the first tick at or after w->tick at which a slot has to be fired
+ * or cascaded, or -1 if the wheel is empty. With expiry, slots of the upper
+ * levels count with the earliest expiry they hold instead: that is when
+ * the next timeout is due, the cascades before it can as well be done then.
+ * Stale bits left behind by uloop_timeout_cancel() are cleared here.
+ */
+static int64_t _uloop_timer_wheel_next(struct uloop_timer_wheel *w, bool expiry){
+	int64_t next = -1;
+	int level;
+
+	for (level = 0; level < ULOOP_WHEEL_LEVELS; level++) {
+		int shift = level * ULOOP_WHEEL_BITS;
+		int64_t base = (w->tick + ((int64_t)1 << shift) - 1) >> shift;
+		int64_t tick;
+		uint64_t bits;
+		int slot;
+
+		while ((bits = _uloop_rotr64(w->pending[level], base & ULOOP_WHEEL_MASK))) {
+			slot = (base + __builtin_ctzll(bits)) & ULOOP_WHEEL_MASK;
+			if (!list_empty(&w->slots[level][slot]))
+				break;
 
-	list_for_each_entry(tmp, &self->processes, list) {
-		if (tmp->pid > p->pid) {
-			h = &tmp->list;
-			break;
+			w->pending[level] &= ~((uint64_t)1 << slot);
 		}
+
+		if (!bits)
+			continue;
+
+		tick = (base + __builtin_ctzll(bits)) << shift;
+		if (expiry && level && w->first[level][slot] > tick)
+			tick = w->first[level][slot];
+		if (next < 0 || tick < next)
+			next = tick;
 	}
 
-	list_add_tail(&p->list, h);
-	p->pending = true;
+	return next;
+}
 
-	return 0;
+/* move the slots that start at the current tick down to the lower levels */
+static void _uloop_timer_wheel_cascade(struct uloop_timer_wheel *w){
+	struct uloop_timeout *t, *tmp;
+	struct list_head cascade;
+	int level, slot, shift;
+
+	for (level = 1; level < ULOOP_WHEEL_LEVELS; level++) {
+		shift = level * ULOOP_WHEEL_BITS;
+		if (w->tick & (((int64_t)1 << shift) - 1))
+			break;
+
+		slot = (w->tick >> shift) & ULOOP_WHEEL_MASK;
+		if (!(w->pending[level] & ((uint64_t)1 << slot)))
+			continue;
+
+		w->pending[level] &= ~((uint64_t)1 << slot);
+
+		INIT_LIST_HEAD(&cascade);
+		list_splice_init(&w->slots[level][slot], &cascade);
+		list_for_each_entry_safe(t, tmp, &cascade, list)
+			_uloop_timer_wheel_insert(w, t);
+	}
 }
 
-int uloop_remove_process(struct uloop *self, struct uloop_process *p){
-	if (!p->pending)
+int uloop_add_timeout(struct uloop *self, struct uloop_timeout *timeout){
+	if (timeout->pending)
 		return -1;
 
-	list_del(&p->list);
-	p->pending = false;
+	if (timeout->hires)
+		return _uloop_add_hires_timeout(self, timeout);
+
+	timeout->expires = _uloop_apply_slack(_tv_ms(&timeout->time), timeout->slack);
+	_uloop_timer_wheel_insert(&self->timeouts, timeout);
+	timeout->pending = true;
 
 	return 0;
 }
 
-static void _uloop_handle_processes(struct uloop *self)
-{
-	struct uloop_process *p, *tmp;
-	pid_t pid;
-	int ret;
+int uloop_add_timeout_ms(struct uloop *self, struct uloop_timeout *timeout, int msecs){
+	if (timeout->pending)
+		return -1;
 
-	self->do_sigchld = false;
+	timeout->hires = false;
+	_ns_tv(self->now + (int64_t)msecs * 1000000, &timeout->time);
 
-	while (1) {
-		pid = waitpid(-1, &ret, WNOHANG);
-		if (pid <= 0)
-			return;
+	return uloop_add_timeout(self, timeout);
+}
 
-		list_for_each_entry_safe(p, tmp, &self->processes, list) {
-			if (p->pid < pid)
-				continue;
+int uloop_add_timeout_ns(struct uloop *self, struct uloop_timeout *timeout, int64_t nsecs){
+	if (timeout->pending)
+		return -1;
 
-			if (p->pid > pid)
-				break;
+	timeout->hires = true;
+	timeout->expires_ns = self->now + nsecs;
+	_ns_tv(timeout->expires_ns, &timeout->time);
 
-			uloop_remove_process(self, p);
-			p->cb(p, ret);
-		}
-	}
+	return uloop_add_timeout(self, timeout);
+}
 
+int uloop_remove_timeout(struct uloop *self, struct uloop_timeout *timeout){
+	return uloop_timeout_cancel(timeout);
 }
 
-static void _uloop_handle_sigint(int signo){
-	// TODO: keep a list of uloops and send signal to all!
-	//self->cancelled = true;
+int uloop_add_defer(struct uloop *self, struct uloop_defer *d){
+	if (d->pending)
+		return -1;
+
+	list_add_tail(&d->list, &self->deferred);
+	d->pending = true;
+
+	return 0;
 }
 
-static void _uloop_sigchld(int signo){
-	// TODO: keep a list of uloops and send signal to all!
-	//self->do_sigchld = true;
+int uloop_remove_defer(struct uloop *self, struct uloop_defer *d){
+	if (!d->pending)
+		return -1;
+
+	list_del(&d->list);
+	d->pending = false;
+
+	return 0;
 }
 
-static void _uloop_install_handler(int signum, void (*handler)(int), struct sigaction* old, bool add){
-	struct sigaction s;
-	struct sigaction *act;
+static void _uloop_run_deferred(struct uloop *self){
+	struct uloop_defer *d;
+	struct list_head run;
 
-	act = NULL;
-	sigaction(signum, NULL, &s);
+	/* anything deferred from here on waits for the next iteration */
+	INIT_LIST_HEAD(&run);
+	list_splice_init(&self->deferred, &run);
 
-	if (add) {
-		if (s.sa_handler == SIG_DFL) { /* Do not override existing custom signal handlers */
-			memcpy(old, &s, sizeof(struct sigaction));
-			s.sa_handler = handler;
-			s.sa_flags = 0;
-			act = &s;
-		}
+	while (!list_empty(&run)) {
+		struct uloop_watchdog_frame wdf = { 0 };
+
+		d = list_first_entry(&run, struct uloop_defer, list);
+
+		list_del(&d->list);
+		d->pending = false;
+		if (self->watchdog)
+			_uloop_watchdog_enter(self->watchdog, &wdf, d->cb, d, -1);
+		d->cb(d);
+		if (self->watchdog)
+			_uloop_watchdog_leave(self->watchdog, &wdf);
 	}
-	else if (s.sa_handler == handler) { /* Do not restore if someone modified our handler */
-			act = old;
+}
+
+static void _uloop_process_cb(struct uloop_fd *fd, unsigned int events){
+	struct uloop_process *p = container_of(fd, struct uloop_process, fd);
+	pid_t pid;
+	int ret = -1;
+
+	do {
+		pid = waitpid(p->pid, &ret, WNOHANG);
+	} while (pid < 0 && errno == EINTR);
+
+	/* not exited yet */
+	if (!pid)
+		return;
+
+	/* reaped by someone else, the exit status is lost */
+	if (pid < 0)
+		ret = -1;
+
+	uloop_remove_process(p->loop, p);
+	p->cb(p, ret);
+}
+
+int uloop_add_process(struct uloop *self, struct uloop_process *p){
+	int fd;
+
+	if (p->pending)
+		return -1;
+
+	fd = syscall(SYS_pidfd_open, p->pid, 0);
+	if (fd < 0)
+		return -1;
+
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+
+	memset(&p->fd, 0, sizeof(p->fd));
+	p->fd.fd = fd;
+	p->fd.cb = _uloop_process_cb;
+	if (uloop_add_fd(self, &p->fd, ULOOP_READ) < 0) {
+		close(fd);
+		return -1;
 	}
 
-	if (act != NULL)
-		sigaction(signum, act, NULL);
+	list_add_tail(&p->list, &self->processes);
+	p->loop = self;
+	p->pending = true;
+
+	return 0;
+}
+
+int uloop_remove_process(struct uloop *self, struct uloop_process *p){
+	if (!p->pending)
+		return -1;
+
+	uloop_remove_fd(self, &p->fd);
+	close(p->fd.fd);
+	p->fd.fd = -1;
+
+	list_del(&p->list);
+	p->pending = false;
+
+	return 0;
 }
 
 static void _uloop_ignore_signal(int signum, bool ignore)
@@ -386,53 +1197,125 @@ static void _uloop_ignore_signal(int signum, bool ignore)
 	}
 }
 
-static void _uloop_setup_signals(bool add)
+static void _uloop_setup_signals(struct uloop *self, bool add)
 {
-	static struct sigaction old_sigint, old_sigchld, old_sigterm;
-
-	_uloop_install_handler(SIGINT, _uloop_handle_sigint, &old_sigint, add);
-	_uloop_install_handler(SIGTERM, _uloop_handle_sigint, &old_sigterm, add);
-	_uloop_install_handler(SIGCHLD, _uloop_sigchld, &old_sigchld, add);
+	_uloop_cancel_on_signal(self, &self->sigint, SIGINT, add);
+	_uloop_cancel_on_signal(self, &self->sigterm, SIGTERM, add);
 
 	_uloop_ignore_signal(SIGPIPE, add);
 }
 
-static int _uloop_get_next_timeout(struct uloop *self, struct timeval *tv)
+static int _uloop_get_next_timeout(struct uloop *self, int64_t now)
 {
-	struct uloop_timeout *timeout;
-	int diff;
+	int64_t next = _uloop_timer_wheel_next(&self->timeouts, true);
+	int64_t diff;
 
-	if (list_empty(&self->timeouts))
+	if (next < 0)
 		return -1;
 
-	timeout = list_first_entry(&self->timeouts, struct uloop_timeout, list);
-	diff = _tv_diff(&timeout->time, tv);
+	diff = next - now;
 	if (diff < 0)
 		return 0;
 
+	if (diff > INT_MAX)
+		return INT_MAX;
+
 	return diff;
 }
 
-static void _uloop_process_timeouts(struct uloop *self, struct timeval *tv){
+static void _uloop_process_timeouts(struct uloop *self, int64_t now){
+	struct uloop_timer_wheel *w = &self->timeouts;
 	struct uloop_timeout *t;
+	struct list_head expired;
+	int64_t next;
+	int slot;
 
-	while (!list_empty(&self->timeouts)) {
-		t = list_first_entry(&self->timeouts, struct uloop_timeout, list);
+	while (w->tick <= now) {
+		_uloop_timer_wheel_cascade(w);
 
-		if (_tv_diff(&t->time, tv) > 0)
-			break;
+		slot = w->tick & ULOOP_WHEEL_MASK;
+		INIT_LIST_HEAD(&expired);
+		list_splice_init(&w->slots[0][slot], &expired);
+		w->pending[0] &= ~((uint64_t)1 << slot);
 
-		uloop_timeout_cancel(t);
-		if (t->cb)
-			t->cb(t);
+		/* timeouts re-armed from a callback land on the next tick */
+		w->tick++;
+
+		while (!list_empty(&expired)) {
+			struct uloop_watchdog_frame wdf = { 0 };
+			int64_t start = ULOOP_STATS_NOW();
+
+			t = list_first_entry(&expired, struct uloop_timeout, list);
+			ULOOP_STATS_RECORD(self, timer_late_ns, start - t->expires * 1000000);
+
+			uloop_timeout_cancel(t);
+			if (self->watchdog)
+				_uloop_watchdog_enter(self->watchdog, &wdf, t->cb, t, -1);
+			if (t->cb)
+				t->cb(t);
+			if (self->watchdog)
+				_uloop_watchdog_leave(self->watchdog, &wdf);
+
+			ULOOP_STATS_RECORD(self, callback_ns, ULOOP_STATS_NOW() - start);
+		}
+
+		/* skip over ticks that have nothing to fire or cascade */
+		next = _uloop_timer_wheel_next(w, false);
+		if (next < 0 || next > now)
+			next = now + 1;
+
+		w->tick = next;
 	}
 }
 
 static void _uloop_clear_timeouts(struct uloop *self){
 	struct uloop_timeout *t, *tmp;
+	int level, slot;
 
-	list_for_each_entry_safe(t, tmp, &self->timeouts, list)
+	for (level = 0; level < ULOOP_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < ULOOP_WHEEL_SIZE; slot++) {
+			list_for_each_entry_safe(t, tmp, &self->timeouts.slots[level][slot], list)
+				uloop_timeout_cancel(t);
+		}
+		self->timeouts.pending[level] = 0;
+	}
+
+	list_for_each_entry_safe(t, tmp, &self->hires_timeouts, list)
 		uloop_timeout_cancel(t);
+
+	/* unregistered while the backend is still there to drop it */
+	if (self->hires_fd.fd >= 0) {
+		uloop_remove_fd(self, &self->hires_fd);
+		close(self->hires_fd.fd);
+	}
+	self->hires_fd.fd = -1;
+	self->hires_armed = 0;
+}
+
+static void _uloop_clear_signals(struct uloop *self){
+	struct uloop_signal *s, *tmp;
+
+	if (self->signal_fd.fd >= 0) {
+		uloop_remove_fd(self, &self->signal_fd);
+		close(self->signal_fd.fd);
+	}
+	self->signal_fd.fd = -1;
+
+	list_for_each_entry_safe(s, tmp, &self->signals, list) {
+		list_del(&s->list);
+		s->pending = false;
+	}
+
+	pthread_sigmask(SIG_UNBLOCK, &self->signal_blocked, NULL);
+	sigemptyset(&self->signal_blocked);
+	sigemptyset(&self->signal_mask);
+}
+
+static void _uloop_clear_deferred(struct uloop *self){
+	struct uloop_defer *d, *tmp;
+
+	list_for_each_entry_safe(d, tmp, &self->deferred, list)
+		uloop_remove_defer(self, d);
 }
 
 static void _uloop_clear_processes(struct uloop *self){
@@ -443,29 +1326,40 @@ static void _uloop_clear_processes(struct uloop *self){
 }
 
 int uloop_process_events(struct uloop *self){
-	struct timeval tv;
-	clock_monotonic(&tv);
-	_uloop_process_timeouts(self, &tv);
+	/* read again after a wait that may block, see uloop_now() */
+	self->now = clock_monotonic_ns();
+
+	/* the watchdog signals whichever thread runs the loop */
+	if (self->watchdog)
+		__atomic_store_n(&self->watchdog->loop_thread, pthread_self(), __ATOMIC_RELAXED);
 
-	if (self->do_sigchld)
-		_uloop_handle_processes(self);
+	_uloop_process_timeouts(self, uloop_now(self));
+
+	/* events of the last wait go first, also when dispatched one per call */
+	if (!self->cur_nfds)
+		_uloop_run_deferred(self);
 
 	if (self->cancelled)
 		return -1;
 
-	clock_monotonic(&tv);
-	_uloop_run_events(self, _uloop_get_next_timeout(self, &tv));
+	/* callbacks deferred by deferred callbacks must not wait for events */
+	if (!list_empty(&self->deferred)) {
+		_uloop_run_events(self, 0);
+		return 0;
+	}
+
+	_uloop_run_events(self, _uloop_get_next_timeout(self, uloop_now(self)));
 	return 0; 
 }
 
 void uloop_run(struct uloop *self){
 
 	/*
-	 * Handlers are only updated for the first call to uloop_run() (and restored
-	 * when this call is done).
+	 * Signal watchers are only added for the first call to uloop_run() (and
+	 * removed when this call is done).
 	 */
 	if (!self->recursive_calls++)
-		_uloop_setup_signals(true);
+		_uloop_setup_signals(self, true);
 
 	self->cancelled = false;
 	while(!self->cancelled){
@@ -473,23 +1367,59 @@ void uloop_run(struct uloop *self){
 	}
 
 	if (!--self->recursive_calls)
-		_uloop_setup_signals(false);
+		_uloop_setup_signals(self, false);
 }
 
 void uloop_destroy(struct uloop *self){
 	if (self->poll_fd < 0)
 		return;
 
-	close(self->poll_fd);
-	self->poll_fd = -1;
+	uloop_watchdog_stop(self);
+
+	/*
+	 * an owned pool must not complete work into a loop that is going away,
+	 * its workers post completions through the wakeup eventfd, so they are
+	 * joined before that is closed
+	 */
+	if (self->work_pool_owned)
+		uloop_work_pool_delete(&self->work_pool);
+	self->work_pool = NULL;
+	self->work_pool_owned = false;
 
+	/* these unregister their fds, which needs the backend */
 	_uloop_clear_timeouts(self);
+	_uloop_clear_deferred(self);
 	_uloop_clear_processes(self);
+	_uloop_clear_signals(self);
+
+	self->backend->destroy(self);
+	self->poll_fd = -1;
+
+	if (self->wakeup.fd >= 0)
+		close(self->wakeup.fd);
+	self->wakeup.fd = -1;
+	self->wakeup.registered = false;
+
+	/* tasks that never got to run are dropped */
+	while (self->posted) {
+		struct uloop_post_task *task = self->posted;
+
+		self->posted = task->next;
+		free(task);
+	}
+
+	free(self->cur_fds);
+	self->cur_fds = NULL;
+	self->cur_fd = self->cur_nfds = 0;
+
+	free(self->stats);
+	self->stats = NULL;
 }
 
 void uloop_delete(struct uloop **self){
 	assert(self); 
 	uloop_destroy(*self); 
+	free(*self); 
 	*self = NULL; 
 }
 
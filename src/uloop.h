@@ -49,6 +49,11 @@
 
 #ifdef USE_EPOLL
 #include <sys/epoll.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_IO_URING
+#endif
+#endif
 #endif
 #include <sys/wait.h>
 
@@ -59,9 +64,14 @@
 struct uloop_fd;
 struct uloop_timeout;
 struct uloop_process;
+struct uloop_signal;
+struct uloop_defer;
 
 typedef void (*uloop_fd_handler)(struct uloop_fd *u, unsigned int events);
 typedef void (*uloop_process_handler)(struct uloop_process *c, int ret);
+typedef void (*uloop_post_handler)(void *arg);
+typedef void (*uloop_signal_handler)(struct uloop_signal *s);
+typedef void (*uloop_defer_handler)(struct uloop_defer *d);
 
 #define ULOOP_READ		(1 << 0)
 #define ULOOP_WRITE		(1 << 1)
@@ -74,16 +84,24 @@ typedef void (*uloop_process_handler)(struct uloop_process *c, int ret);
 #define ULOOP_EVENT_BUFFERED	(1 << 4)
 #ifdef USE_KQUEUE
 #define ULOOP_EDGE_DEFER	(1 << 5)
+#else
+/* internal: an interest change is queued until the next wait (epoll) */
+#define ULOOP_CTL_QUEUED	(1 << 5)
 #endif
 
 #define ULOOP_ERROR_CB		(1 << 6)
 
+/* internal: a poll request for this fd is queued or in flight (io_uring) */
+#define ULOOP_POLL_ARMED	(1 << 7)
+
 struct uloop_fd
 {
 	uloop_fd_handler cb;
 	int fd;
 	bool eof;
 	bool error;
+	/* set along with error when the fd hung up */
+	bool hangup;
 	bool registered;
 	uint8_t flags;
 };
@@ -95,6 +113,29 @@ struct uloop_process
 
 	uloop_process_handler cb;
 	pid_t pid;
+
+	/* pidfd of the child, readable once it has exited */
+	struct uloop_fd fd;
+	struct uloop *loop;
+};
+
+struct uloop_signal
+{
+	struct list_head list;
+	bool pending;
+
+	uloop_signal_handler cb;
+	int signo;
+
+	struct uloop *loop;
+};
+
+struct uloop_defer
+{
+	struct list_head list;
+	bool pending;
+
+	uloop_defer_handler cb;
 };
 
 struct uloop_fd_event {
@@ -102,6 +143,14 @@ struct uloop_fd_event {
 	unsigned int events;
 };
 
+/* internal: interest of a fd as registered with epoll before a queued change */
+struct uloop_fd_change {
+	struct uloop_fd *fd;
+	unsigned int flags;
+	/* edge triggered fd got read or write interest back, MOD even if unchanged */
+	bool rearm;
+};
+
 struct uloop_fd_stack {
 	struct uloop_fd_stack *next;
 	struct uloop_fd *fd;
@@ -110,35 +159,252 @@ struct uloop_fd_stack {
 
 #define ULOOP_MAX_EVENTS 10
 
+enum uloop_backend_type {
+	ULOOP_BACKEND_DEFAULT = 0,
+	ULOOP_BACKEND_EPOLL,
+	/* falls back to epoll if io_uring is not available */
+	ULOOP_BACKEND_IO_URING,
+};
+
+struct uloop;
+struct uloop_io_uring;
+struct uloop_work_pool;
+struct ustream_pool;
+struct uloop_stats;
+struct uloop_watchdog;
+struct ustream;
+
+/* internal: node of the uloop_post() queue, freed once cb has run */
+struct uloop_post_task {
+	struct uloop_post_task *next;
+	uloop_post_handler cb;
+	void *arg;
+};
+
+/* internal: polling mechanism behind a loop */
+struct uloop_backend {
+	const char *name;
+
+	/* sets up self->poll_fd and any backend state, returns < 0 on error */
+	int (*init)(struct uloop *self);
+	void (*destroy)(struct uloop *self);
+
+	/* called with the new flags, fd->registered tells add from modify */
+	int (*register_fd)(struct uloop *self, struct uloop_fd *fd, unsigned int flags);
+	int (*unregister_fd)(struct uloop *self, struct uloop_fd *fd);
+
+	/*
+	 * waits up to timeout ms (-1: forever) and fills self->cur_fds,
+	 * returns the number of entries filled in
+	 */
+	int (*fetch_events)(struct uloop *self, int timeout);
+};
+
+#ifdef USE_IO_URING
+extern const struct uloop_backend uloop_io_uring_backend;
+#endif
+
+/*
+ * uloop_options: passed to uloop_init_options() / uloop_new_options(),
+ * zeroed fields are replaced with their defaults.
+ */
+struct uloop_options {
+	/* number of events fetched per wait (default: ULOOP_MAX_EVENTS) */
+	int max_events;
+
+	/*
+	 * dispatch every fetched event before uloop_process_events() returns
+	 * instead of returning after the first fd callback
+	 */
+	bool drain_events;
+
+	/* polling mechanism to use (default: epoll) */
+	enum uloop_backend_type backend;
+
+	/*
+	 * spin with zero timeout waits for up to this many microseconds before
+	 * blocking (default: 0, never spin). the budget adapts to how often
+	 * spinning actually finds events.
+	 */
+	int busy_poll_us;
+
+	/* SO_BUSY_POLL value set on sockets added to the loop (default: 0, unset) */
+	int busy_poll_sock_us;
+
+	/* report callbacks running longer than this, see uloop_watchdog.h (default: 0, off) */
+	int watchdog_ms;
+};
+
+/*
+ * Timeouts are kept in a hierarchical timing wheel with millisecond ticks.
+ * Level 0 holds timeouts due within the next ULOOP_WHEEL_SIZE ticks, every
+ * following level covers ULOOP_WHEEL_SIZE times the range of the previous
+ * one and is cascaded down one level whenever the level below wraps.
+ * Timeouts beyond the range of the last level are parked in its furthest
+ * slot and re-inserted when that slot is cascaded.
+ */
+#define ULOOP_WHEEL_BITS	6
+#define ULOOP_WHEEL_SIZE	(1 << ULOOP_WHEEL_BITS)
+#define ULOOP_WHEEL_MASK	(ULOOP_WHEEL_SIZE - 1)
+#define ULOOP_WHEEL_LEVELS	5
+
+struct uloop_timer_wheel {
+	struct list_head slots[ULOOP_WHEEL_LEVELS][ULOOP_WHEEL_SIZE];
+	/* set bits mark slots that may hold timeouts (cleared lazily) */
+	uint64_t pending[ULOOP_WHEEL_LEVELS];
+	/* earliest expiry added to each slot since it was last empty */
+	int64_t first[ULOOP_WHEEL_LEVELS][ULOOP_WHEEL_SIZE];
+	/* next tick that has not been processed yet */
+	int64_t tick;
+};
+
 struct uloop {
+	const struct uloop_backend *backend; 
+	struct uloop_io_uring *ring; 
 	struct uloop_fd_stack *fd_stack; 
-	struct list_head timeouts; 
+	struct uloop_timer_wheel timeouts; 
+	/* uloop_timeout_set_ns() timeouts, sorted by expiry, fired by a timerfd */
+	struct list_head hires_timeouts;
+	struct uloop_fd hires_fd;
+	int64_t hires_armed;
 	struct list_head processes;
+	/* uloop_defer callbacks to run before the next wait */
+	struct list_head deferred;
 	int poll_fd;
 	bool cancelled;
-	bool do_sigchld;
-	struct uloop_fd_event cur_fds[ULOOP_MAX_EVENTS];
-	struct epoll_event events[ULOOP_MAX_EVENTS];
+	bool drain_events;
+	struct uloop_fd_event *cur_fds;
+	struct epoll_event *events;
+	int max_events;
+	/* epoll_ctl(MOD) calls queued for the next wait, see _uloop_epoll_flush() */
+	struct uloop_fd_change *fd_changes;
+	int fd_nchanges, fd_changes_size;
 	int cur_fd, cur_nfds;
 	int recursive_calls;
+
+	/* CLOCK_MONOTONIC in ns, read at the start of every iteration and after its wait */
+	int64_t now;
+
+	/* busy polling: budget limit and current budget (ns), SO_BUSY_POLL (us) */
+	int64_t busy_poll_max;
+	int64_t busy_poll_budget;
+	int busy_poll_sock;
+	/* time spent spinning, and spins that did / did not find events */
+	uint64_t busy_poll_spin_ns;
+	uint64_t busy_poll_hits, busy_poll_misses;
+
+	/* histograms, only allocated when built with ULOOP_STATS */
+	struct uloop_stats *stats;
+
+	/* stall reporting thread, see uloop_watchdog_start() */
+	struct uloop_watchdog *watchdog;
+
+	/* eventfd and lock-free stack of tasks posted with uloop_post() */
+	struct uloop_fd wakeup;
+	struct uloop_post_task *posted;
+
+	/* workers running uloop_work_submit() jobs, see uloop_work.h */
+	struct uloop_work_pool *work_pool;
+	bool work_pool_owned;
+
+	/* buffers of the streams on this loop, see ustream_pool.h */
+	struct ustream_pool *buf_pool;
+
+	/* signalfd shared by all uloop_signal watchers of this loop */
+	struct uloop_fd signal_fd;
+	struct list_head signals;
+	/* next watcher _uloop_signal_cb() calls, moved on by uloop_remove_signal() */
+	struct list_head *signal_next;
+	/* signals the signalfd listens for / signals blocked by the loop */
+	sigset_t signal_mask;
+	sigset_t signal_blocked;
+	/* installed by uloop_run() to cancel the loop on SIGINT and SIGTERM */
+	struct uloop_signal sigint, sigterm;
 }; 
 
 int uloop_add_fd(struct uloop *self, struct uloop_fd *sock, unsigned int flags);
 int uloop_remove_fd(struct uloop *self, struct uloop_fd *sock);
 
+/* (re)register a ustream_fd with the events its buffers currently need */
+void uloop_add_ustream(struct uloop *self, struct ustream *s, bool write);
+
 int uloop_add_timeout(struct uloop *self, struct uloop_timeout *timeout);
 int uloop_remove_timeout(struct uloop *self, struct uloop_timeout *timeout); 
 
+/*
+ * uloop_add_timeout_ms / uloop_add_timeout_ns: arm and add a timeout
+ * relative to uloop_now(), without reading the clock
+ */
+int uloop_add_timeout_ms(struct uloop *self, struct uloop_timeout *timeout, int msecs);
+int uloop_add_timeout_ns(struct uloop *self, struct uloop_timeout *timeout, int64_t nsecs);
+
+/*
+ * uloop_now: monotonic time in ms as of the start of the current loop
+ * iteration, or as of the end of its wait for events for callbacks run
+ * after that wait. it does not advance while callbacks run.
+ */
+static inline int64_t uloop_now(struct uloop *self)
+{
+	return self->now / 1000000;
+}
+
+static inline int64_t uloop_now_ns(struct uloop *self)
+{
+	return self->now;
+}
+
+/*
+ * uloop_post: run cb(arg) on the thread running the loop
+ *
+ * may be called from any thread, the callbacks run in the order they were
+ * posted. returns -1 if the task could not be allocated.
+ */
+int uloop_post(struct uloop *self, uloop_post_handler cb, void *arg);
+
+/* internal: uloop_post() with a malloc()ed task, the loop frees it */
+void uloop_post_task(struct uloop *self, struct uloop_post_task *task);
+
+/*
+ * uloop_add_defer: run d->cb once, at the end of the current loop iteration
+ *
+ * deferred callbacks run in the order they were added, before the loop
+ * waits for events again and after the events fetched by the last wait
+ * were all dispatched, also without drain_events. callbacks deferred from
+ * a deferred callback run in the next iteration, which does not block in
+ * the meantime.
+ */
+int uloop_add_defer(struct uloop *self, struct uloop_defer *d);
+int uloop_remove_defer(struct uloop *self, struct uloop_defer *d);
+
 int uloop_add_process(struct uloop *self, struct uloop_process *p);
 int uloop_remove_process(struct uloop *self, struct uloop_process *p);
 
+/*
+ * uloop_add_signal: call s->cb on this loop whenever s->signo is delivered
+ *
+ * signals are read from a per-loop signalfd, so they arrive as ordinary fd
+ * events and the callback may do anything a fd callback may do. the signal
+ * is blocked in the calling thread while it has watchers. process directed
+ * signals are only routed to the signalfd if every other thread blocks the
+ * signal as well, so block it before starting threads where that matters.
+ */
+int uloop_add_signal(struct uloop *self, struct uloop_signal *s);
+int uloop_remove_signal(struct uloop *self, struct uloop_signal *s);
+
 struct uloop *uloop_new(void); 
+struct uloop *uloop_new_options(const struct uloop_options *opts); 
 void uloop_delete(struct uloop **self); 
 
-void uloop_init(struct uloop *self);
+int uloop_init(struct uloop *self);
+int uloop_init_options(struct uloop *self, const struct uloop_options *opts);
 void uloop_destroy(struct uloop *self); 
 
 int uloop_process_events(struct uloop *self); 
 
+static inline const char *uloop_backend_name(struct uloop *self)
+{
+	return self->backend->name;
+}
+
 void uloop_run(struct uloop *self);
 
@@ -0,0 +1,503 @@
+/*
+ * uloop_coro - C++20 coroutines on top of uloop and ustream
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+/*
+ * Header only, needs -std=c++20. Everything runs on the loop's thread:
+ *
+ *	uloop_co::task<> echo(uloop_co::loop &loop, int fd)
+ *	{
+ *		uloop_co::stream s(loop, fd);
+ *
+ *		for (;;) {
+ *			std::string_view data = co_await s.read_some();
+ *			if (data.empty())
+ *				break;
+ *			s.write(data);
+ *			s.consume(data.size());
+ *			if (!co_await s.drain())
+ *				break;
+ *		}
+ *		co_await loop.sleep(100);
+ *	}
+ *
+ *	uloop_co::spawn(echo(loop, fd));
+ *
+ * Coroutine frames come from a per-thread pool of size classes, a frame
+ * that is freed is reused by the next coroutine of similar size. Awaiting
+ * keeps the timeout or wakeup node in the awaiting frame, so suspending and
+ * resuming never allocate and never make syscalls beyond what the
+ * underlying uloop_timeout or ustream does anyway.
+ */
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+#include <unistd.h>
+
+extern "C" {
+#include "uloop.h"
+#include "ustream.h"
+}
+
+namespace uloop_co {
+
+namespace detail {
+
+/*
+ * Free lists of coroutine frames in 64 byte size classes, frames larger
+ * than the biggest class go straight to operator new. Frames freed on
+ * another thread end up in that thread's pool, which is fine since every
+ * block comes from plain operator new.
+ */
+class frame_pool {
+public:
+	static constexpr std::size_t granule = 64;
+	static constexpr std::size_t classes = 32;
+
+	static void *alloc(std::size_t size)
+	{
+		std::size_t c = (size + granule - 1) / granule;
+		frame_pool &p = instance();
+
+		if (c >= classes)
+			return ::operator new(size);
+
+		if (node *n = p.free_[c]) {
+			p.free_[c] = n->next;
+			return n;
+		}
+
+		return ::operator new(c * granule);
+	}
+
+	static void free(void *ptr, std::size_t size) noexcept
+	{
+		std::size_t c = (size + granule - 1) / granule;
+		frame_pool &p = instance();
+		node *n;
+
+		if (c >= classes) {
+			::operator delete(ptr);
+			return;
+		}
+
+		n = static_cast<node *>(ptr);
+		n->next = p.free_[c];
+		p.free_[c] = n;
+	}
+
+	~frame_pool()
+	{
+		for (node *&head : free_) {
+			while (node *n = head) {
+				head = n->next;
+				::operator delete(n);
+			}
+		}
+	}
+
+private:
+	struct node {
+		node *next;
+	};
+
+	node *free_[classes] = {};
+
+	static frame_pool &instance()
+	{
+		static thread_local frame_pool pool;
+		return pool;
+	}
+};
+
+struct promise_base {
+	std::coroutine_handle<> continuation = std::noop_coroutine();
+	std::exception_ptr error;
+
+	static void *operator new(std::size_t size)
+	{
+		return frame_pool::alloc(size);
+	}
+
+	static void operator delete(void *ptr, std::size_t size) noexcept
+	{
+		frame_pool::free(ptr, size);
+	}
+
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+
+		/* symmetric transfer: the awaiting coroutine resumes without recursion */
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			return h.promise().continuation;
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception() noexcept
+	{
+		error = std::current_exception();
+	}
+};
+
+template <typename T>
+struct promise : promise_base {
+	std::optional<T> value;
+
+	template <typename U>
+	void return_value(U &&v)
+	{
+		value.emplace(std::forward<U>(v));
+	}
+
+	T result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct promise<void> : promise_base {
+	void return_void() noexcept {}
+
+	void result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+} /* namespace detail */
+
+/*
+ * task: a lazily started coroutine, it runs once it is awaited (or handed
+ * to spawn()) and resumes its awaiter when it is done.
+ */
+template <typename T = void>
+class task {
+public:
+	struct promise_type : detail::promise<T> {
+		task get_return_object()
+		{
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+	};
+
+	task(task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	~task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	auto operator co_await() && noexcept
+	{
+		struct awaiter {
+			std::coroutine_handle<promise_type> h;
+
+			bool await_ready() noexcept { return !h || h.done(); }
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept
+			{
+				h.promise().continuation = cont;
+				return h;
+			}
+
+			T await_resume() { return h.promise().result(); }
+		};
+
+		return awaiter{h_};
+	}
+
+private:
+	explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+	std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+/* runs a task to completion and frees itself, exceptions are fatal */
+struct detached {
+	struct promise_type {
+		static void *operator new(std::size_t size)
+		{
+			return frame_pool::alloc(size);
+		}
+
+		static void operator delete(void *ptr, std::size_t size) noexcept
+		{
+			frame_pool::free(ptr, size);
+		}
+
+		detached get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+inline detached run_detached(task<> t)
+{
+	co_await std::move(t);
+}
+
+} /* namespace detail */
+
+/* spawn: start t now and let it run on its own until it completes */
+inline void spawn(task<> t)
+{
+	detail::run_detached(std::move(t));
+}
+
+class loop;
+
+/* awaiter of loop::sleep(), the timeout lives in the awaiting frame */
+class sleep_awaiter {
+public:
+	sleep_awaiter(struct uloop *l, int msecs) : t_{}, loop_(l), msecs_(msecs) {}
+	sleep_awaiter(const sleep_awaiter &) = delete;
+	sleep_awaiter &operator=(const sleep_awaiter &) = delete;
+
+	/* a frame destroyed while it sleeps must not leave the timeout behind */
+	~sleep_awaiter()
+	{
+		if (t_.t.pending)
+			uloop_remove_timeout(loop_, &t_.t);
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		t_.t.cb = &timer::fire;
+		t_.h = h;
+		uloop_add_timeout_ms(loop_, &t_.t, msecs_);
+	}
+
+	void await_resume() const noexcept {}
+
+private:
+	/* t first, so the callback gets from the timeout back to the handle */
+	struct timer {
+		struct uloop_timeout t;
+		std::coroutine_handle<> h;
+
+		static void fire(struct uloop_timeout *t)
+		{
+			reinterpret_cast<timer *>(t)->h.resume();
+		}
+	};
+
+	timer t_;
+	struct uloop *loop_;
+	int msecs_;
+};
+
+/* loop: non owning handle of a struct uloop */
+class loop {
+public:
+	explicit loop(struct uloop *l) noexcept : loop_(l) {}
+
+	struct uloop *get() const noexcept { return loop_; }
+
+	/* sleep: resume after msecs, measured from uloop_now() */
+	sleep_awaiter sleep(int msecs) const noexcept
+	{
+		return sleep_awaiter(loop_, msecs);
+	}
+
+	void run() { uloop_run(loop_); }
+
+private:
+	struct uloop *loop_;
+};
+
+/*
+ * stream: a ustream_fd driven by coroutines, it owns the fd and closes it.
+ *
+ * One coroutine may wait in read_some() and one in drain() at a time.
+ * Waiters are resumed from a uloop_defer at the end of the loop iteration,
+ * never from inside the ustream callbacks, so a resumed coroutine may do
+ * anything with the stream, including destroying it. It must not destroy a
+ * stream another coroutine is still waiting on.
+ */
+class stream {
+public:
+	stream(loop &l, int fd) : stream(l.get(), fd) {}
+
+	stream(struct uloop *l, int fd)
+	{
+		fd_.self = this;
+		wake_.self = this;
+		wake_.d.cb = &waker::fire;
+
+		fd_.sf.stream.notify_read = &stream::notify;
+		fd_.sf.stream.notify_write = &stream::notify;
+		fd_.sf.stream.notify_state = &stream::notify_state;
+		ustream_fd_init(&fd_.sf, l, fd);
+	}
+
+	stream(const stream &) = delete;
+	stream &operator=(const stream &) = delete;
+
+	~stream()
+	{
+		struct ustream *s = get();
+
+		uloop_remove_defer(s->loop, &wake_.d);
+		ustream_free(s);
+		close(fd_.sf.fd.fd);
+	}
+
+	struct ustream *get() noexcept { return &fd_.sf.stream; }
+
+	bool eof() noexcept { return get()->eof; }
+	bool write_error() noexcept { return get()->write_error; }
+
+	struct read_awaiter {
+		stream *s;
+
+		bool await_ready() noexcept { return s->readable(); }
+		void await_suspend(std::coroutine_handle<> h) noexcept { s->reader_ = h; }
+
+		std::string_view await_resume() noexcept
+		{
+			int len = 0;
+			char *buf = ustream_get_read_buf(s->get(), &len);
+
+			return buf ? std::string_view(buf, len) : std::string_view();
+		}
+	};
+
+	/*
+	 * read_some: wait for buffered input and return the first chunk of it,
+	 * without copying. the data stays buffered until consume() is called.
+	 * an empty view means eof. a peer that hung up still gets everything
+	 * it sent read first, even though that sets write_error() right away.
+	 */
+	read_awaiter read_some() noexcept { return read_awaiter{this}; }
+
+	void consume(std::size_t len) { ustream_consume(get(), static_cast<int>(len)); }
+
+	/* write: ustream_write(), data that does not go out right away is buffered */
+	int write(std::string_view data, bool more = false)
+	{
+		return ustream_write(get(), data.data(), static_cast<int>(data.size()), more);
+	}
+
+	struct drain_awaiter {
+		stream *s;
+
+		bool await_ready() noexcept { return s->drained(); }
+		void await_suspend(std::coroutine_handle<> h) noexcept { s->drainer_ = h; }
+		bool await_resume() noexcept { return !s->write_error(); }
+	};
+
+	/* drain: wait until the write buffer is empty, false on a write error */
+	drain_awaiter drain() noexcept { return drain_awaiter{this}; }
+
+private:
+	struct fd_stream {
+		struct ustream_fd sf;
+		stream *self;
+	};
+
+	struct waker {
+		struct uloop_defer d;
+		stream *self;
+
+		static void fire(struct uloop_defer *d)
+		{
+			reinterpret_cast<waker *>(d)->self->resume_waiters();
+		}
+	};
+
+	bool readable() noexcept
+	{
+		struct ustream *s = get();
+
+		return ustream_get_read_buf(s, nullptr) || s->eof;
+	}
+
+	bool drained() noexcept
+	{
+		struct ustream *s = get();
+
+		return !s->w.data_bytes || s->write_error;
+	}
+
+	static stream *from(struct ustream *s) noexcept
+	{
+		return reinterpret_cast<fd_stream *>(s)->self;
+	}
+
+	static void notify(struct ustream *s, int)
+	{
+		stream *self = from(s);
+
+		if (self->reader_ || self->drainer_)
+			uloop_add_defer(s->loop, &self->wake_.d);
+	}
+
+	static void notify_state(struct ustream *s)
+	{
+		notify(s, 0);
+	}
+
+	void resume_waiters()
+	{
+		std::coroutine_handle<> r, w;
+
+		/* take both first, resuming either one may destroy the stream */
+		if (reader_ && readable())
+			r = std::exchange(reader_, nullptr);
+		if (drainer_ && drained())
+			w = std::exchange(drainer_, nullptr);
+
+		if (r)
+			r.resume();
+		if (w)
+			w.resume();
+	}
+
+	fd_stream fd_{};
+	waker wake_{};
+	std::coroutine_handle<> reader_;
+	std::coroutine_handle<> drainer_;
+};
+
+} /* namespace uloop_co */
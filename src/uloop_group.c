@@ -0,0 +1,187 @@
+/*
+ * uloop_group - event loops running on a pool of threads
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "uloop_group.h"
+
+static void *_uloop_group_thread(void *arg){
+	struct uloop *loop = arg;
+
+	uloop_run(loop);
+	return NULL;
+}
+
+static void _uloop_group_cancel(void *arg){
+	struct uloop *loop = arg;
+
+	loop->cancelled = true;
+}
+
+static void _uloop_group_listen(void *arg){
+	struct uloop_listener *l = arg;
+
+	uloop_listener_add(l->loop, l);
+}
+
+/*
+ * the steering program sends connections that arrive on cpu c to loop
+ * c % nloops, so loop i runs on exactly those cpus (the ones the process
+ * may use at all). a loop without any of them is left alone.
+ */
+static int _uloop_group_pin(struct uloop_group *self){
+	cpu_set_t allowed, set;
+	int i, cpu;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return -1;
+
+	for (i = 0; i < self->nloops; i++) {
+		CPU_ZERO(&set);
+		for (cpu = i; cpu < CPU_SETSIZE; cpu += self->nloops) {
+			if (CPU_ISSET(cpu, &allowed))
+				CPU_SET(cpu, &set);
+		}
+
+		if (!CPU_COUNT(&set))
+			continue;
+
+		if (pthread_setaffinity_np(self->threads[i], sizeof(set), &set))
+			return -1;
+	}
+
+	return 0;
+}
+
+struct uloop_group *uloop_group_new(int nloops, const struct uloop_options *opts){
+	struct uloop_group *self;
+	int i;
+
+	if (nloops <= 0)
+		nloops = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nloops <= 0)
+		nloops = 1;
+
+	self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->loops = calloc(nloops, sizeof(*self->loops));
+	self->threads = calloc(nloops, sizeof(*self->threads));
+	if (!self->loops || !self->threads)
+		goto fail;
+
+	for (i = 0; i < nloops; i++) {
+		self->loops[i] = uloop_new_options(opts);
+		if (!self->loops[i])
+			goto fail;
+
+		if (pthread_create(&self->threads[i], NULL, _uloop_group_thread, self->loops[i])) {
+			uloop_delete(&self->loops[i]);
+			goto fail;
+		}
+
+		self->nloops++;
+	}
+
+	return self;
+
+fail:
+	uloop_group_delete(&self);
+	return NULL;
+}
+
+void uloop_group_stop(struct uloop_group *self){
+	int i;
+
+	if (self->stopped)
+		return;
+
+	for (i = 0; i < self->nloops; i++) {
+		/* retry until the cancel request could be allocated */
+		while (uloop_post(self->loops[i], _uloop_group_cancel, self->loops[i]) < 0)
+			usleep(1000);
+	}
+
+	for (i = 0; i < self->nloops; i++)
+		pthread_join(self->threads[i], NULL);
+
+	self->stopped = true;
+}
+
+void uloop_group_delete(struct uloop_group **self){
+	struct uloop_group *g;
+	int i;
+
+	assert(self);
+	g = *self;
+	if (!g)
+		return;
+
+	uloop_group_stop(g);
+
+	for (i = 0; i < g->nloops; i++)
+		uloop_delete(&g->loops[i]);
+
+	free(g->loops);
+	free(g->threads);
+	free(g);
+	*self = NULL;
+}
+
+struct uloop *uloop_group_next(struct uloop_group *self){
+	unsigned int idx = __atomic_fetch_add(&self->next, 1, __ATOMIC_RELAXED);
+
+	return self->loops[idx % self->nloops];
+}
+
+int uloop_group_listen(struct uloop_group *self, struct uloop_listener *ls, int type,
+		       const char *host, const char *service, bool steer_cpu){
+	int i, opened;
+
+	/* nothing would ever accept on them */
+	if (self->stopped)
+		return -1;
+
+	/* sockets join the reuseport group in order, which the steering relies on */
+	for (opened = 0; opened < self->nloops; opened++) {
+		if (uloop_listener_open(&ls[opened], type, host, service) < 0)
+			goto fail;
+	}
+
+	if (steer_cpu && (uloop_listener_steer_cpu(&ls[0], self->nloops) < 0 ||
+			  _uloop_group_pin(self) < 0))
+		goto fail;
+
+	for (i = 0; i < self->nloops; i++) {
+		ls[i].loop = self->loops[i];
+		while (uloop_post(self->loops[i], _uloop_group_listen, &ls[i]) < 0)
+			usleep(1000);
+	}
+
+	return 0;
+
+fail:
+	for (i = 0; i < opened; i++) {
+		close(ls[i].fd.fd);
+		ls[i].fd.fd = -1;
+	}
+	return -1;
+}
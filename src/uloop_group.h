@@ -0,0 +1,77 @@
+/*
+ * uloop_group - event loops running on a pool of threads
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <pthread.h>
+
+#include "uloop.h"
+#include "uloop_listener.h"
+
+/*
+ * A loop group runs one struct uloop per thread. Each loop is only ever
+ * touched by its own thread, other threads hand work to it with
+ * uloop_post().
+ */
+struct uloop_group {
+	struct uloop **loops;
+	pthread_t *threads;
+	int nloops;
+
+	/* round robin position for uloop_group_next() */
+	unsigned int next;
+
+	/* the threads were joined, the loops are kept until the group is deleted */
+	bool stopped;
+};
+
+/*
+ * uloop_group_new: create nloops loops (nloops <= 0: one per online cpu)
+ * and start a thread running each of them. opts may be NULL.
+ */
+struct uloop_group *uloop_group_new(int nloops, const struct uloop_options *opts);
+
+/* uloop_group_delete: stop all loops, join their threads and free the group */
+void uloop_group_delete(struct uloop_group **self);
+
+/*
+ * uloop_group_stop: ask all loops to leave uloop_run() and wait for them.
+ * the loops stay allocated until uloop_group_delete(), but nothing runs
+ * them any more.
+ */
+void uloop_group_stop(struct uloop_group *self);
+
+static inline struct uloop *uloop_group_get(struct uloop_group *self, int idx)
+{
+	return self->loops[idx % self->nloops];
+}
+
+/* uloop_group_next: pick loops in round robin order, e.g. for new connections */
+struct uloop *uloop_group_next(struct uloop_group *self);
+
+/*
+ * uloop_group_listen: open one SO_REUSEPORT listener per loop
+ *
+ * ls must hold nloops listeners with cb (and optionally accept_batch) set,
+ * ls[i] accepts on loop i. with steer_cpu, connections arriving on cpu c
+ * go to loop c % nloops, and the thread of every loop is pinned to the
+ * cpus that steer to it (just cpu i with one loop per cpu). the listeners
+ * are removed with uloop_listener_remove() on their loop's thread or once
+ * the group is stopped.
+ */
+int uloop_group_listen(struct uloop_group *self, struct uloop_listener *ls, int type,
+		       const char *host, const char *service, bool steer_cpu);
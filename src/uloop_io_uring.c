@@ -0,0 +1,494 @@
+/*
+ * uloop - io_uring polling backend
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Every registered fd has at most one one-shot IORING_OP_POLL_ADD queued
+ * or in flight (ULOOP_POLL_ARMED). Polls are re-armed when their completion
+ * is reaped, and interest changes update the mask of the armed poll.
+ * Requests are only queued in the submission ring and go to the kernel
+ * together with the next wait, so a loop iteration costs a single
+ * io_uring_enter() no matter how many fds changed.
+ *
+ * Completions are reported level triggered, ULOOP_EDGE_TRIGGER only affects
+ * how the loop buffers events for recursive callbacks.
+ */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#include "uloop.h"
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+
+#define ULOOP_IO_URING_ENTRIES	256
+
+struct uloop_io_uring {
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	unsigned int sq_entries;
+
+	/* sqes up to here are filled in, the ones past *sq_head not consumed yet */
+	unsigned int sq_local_tail;
+
+	/* completions taken out of a full ring, see _uloop_io_uring_stash() */
+	struct io_uring_cqe *stash;
+	unsigned int stash_len, stash_size;
+};
+
+static int _io_uring_setup(unsigned int entries, struct io_uring_params *p){
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		unsigned int flags, void *arg, size_t argsz){
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static void _uloop_io_uring_free(struct uloop *self){
+	struct uloop_io_uring *r = self->ring;
+
+	if (r->sqes)
+		munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_size);
+	if (self->poll_fd >= 0)
+		close(self->poll_fd);
+
+	free(r->stash);
+	free(r);
+	self->ring = NULL;
+	self->poll_fd = -1;
+}
+
+static int _uloop_io_uring_init(struct uloop *self){
+	struct io_uring_params p;
+	struct uloop_io_uring *r;
+	unsigned int i;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -1;
+
+	self->ring = r;
+
+	memset(&p, 0, sizeof(p));
+	self->poll_fd = _io_uring_setup(ULOOP_IO_URING_ENTRIES, &p);
+	if (self->poll_fd < 0)
+		goto fail;
+
+	/*
+	 * timed waits need EXT_ARG, NODROP keeps completions from getting lost.
+	 * Poll updates came with 5.13, the same release as RSRC_TAGS.
+	 */
+	if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_RSRC_TAGS))
+		goto fail;
+
+	fcntl(self->poll_fd, F_SETFD, fcntl(self->poll_fd, F_GETFD) | FD_CLOEXEC);
+
+	r->sq_entries = p.sq_entries;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, self->poll_fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, self->poll_fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			goto fail;
+		}
+	}
+
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, self->poll_fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	r->sq_head = (unsigned int *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned int *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)((char *)r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned int *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned int *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+	/* sqes are always used in ring order */
+	for (i = 0; i < r->sq_entries; i++)
+		r->sq_array[i] = i;
+
+	r->sq_local_tail = *r->sq_tail;
+
+	return 0;
+
+fail:
+	_uloop_io_uring_free(self);
+	return -1;
+}
+
+static void _uloop_io_uring_destroy(struct uloop *self){
+	_uloop_io_uring_free(self);
+}
+
+/* publishes queued sqes and enters the kernel */
+static int _uloop_io_uring_submit(struct uloop *self, unsigned int min_complete,
+		unsigned int flags, void *arg, size_t argsz){
+	struct uloop_io_uring *r = self->ring;
+	unsigned int to_submit = r->sq_local_tail - *r->sq_head;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+
+	do {
+		ret = _io_uring_enter(self->poll_fd, to_submit, min_complete, flags, arg, argsz);
+	} while (ret < 0 && errno == EINTR && !min_complete);
+
+	return ret;
+}
+
+static struct io_uring_sqe *_uloop_io_uring_get_sqe(struct uloop *self){
+	struct uloop_io_uring *r = self->ring;
+	struct io_uring_sqe *sqe;
+
+	if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		_uloop_io_uring_submit(self, 0, 0, NULL, 0);
+		if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+			return NULL;
+	}
+
+	sqe = &r->sqes[r->sq_local_tail & *r->sq_mask];
+	r->sq_local_tail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static unsigned int _uloop_io_uring_poll_mask(unsigned int flags){
+	unsigned int mask = 0;
+
+	if (flags & ULOOP_READ)
+		mask |= POLLIN | POLLRDHUP;
+
+	if (flags & ULOOP_WRITE)
+		mask |= POLLOUT;
+
+	return mask;
+}
+
+static int _uloop_io_uring_arm(struct uloop *self, struct uloop_fd *fd){
+	struct io_uring_sqe *sqe = _uloop_io_uring_get_sqe(self);
+
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd->fd;
+	sqe->poll32_events = _uloop_io_uring_poll_mask(fd->flags);
+	sqe->user_data = (uintptr_t)fd;
+	fd->flags |= ULOOP_POLL_ARMED;
+
+	return 0;
+}
+
+static int _uloop_io_uring_cancel(struct uloop *self, struct uloop_fd *fd){
+	struct io_uring_sqe *sqe = _uloop_io_uring_get_sqe(self);
+
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = (uintptr_t)fd;
+	sqe->user_data = 0;
+
+	return 0;
+}
+
+static int _uloop_io_uring_update(struct uloop *self, struct uloop_fd *fd){
+	struct io_uring_sqe *sqe = _uloop_io_uring_get_sqe(self);
+
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->len = IORING_POLL_UPDATE_EVENTS;
+	sqe->addr = (uintptr_t)fd;
+	sqe->poll32_events = _uloop_io_uring_poll_mask(fd->flags);
+	sqe->user_data = 0;
+
+	return 0;
+}
+
+static int _uloop_io_uring_register_fd(struct uloop *self, struct uloop_fd *fd, unsigned int flags){
+	unsigned int armed = fd->flags & ULOOP_POLL_ARMED;
+
+	if (armed && (fd->flags & ~ULOOP_POLL_ARMED) == flags)
+		return 0;
+
+	fd->flags = flags | armed;
+
+	/*
+	 * if the poll completes before the update gets to it, it is re-armed
+	 * with the new flags when the completion is reaped
+	 */
+	if (armed)
+		return _uloop_io_uring_update(self, fd);
+
+	return _uloop_io_uring_arm(self, fd);
+}
+
+/*
+ * moves the completions out of the ring so that the kernel can post more,
+ * fetch_events() hands out stashed completions before the ones in the ring
+ */
+static int _uloop_io_uring_stash(struct uloop_io_uring *r){
+	unsigned int head = *r->cq_head;
+	unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	int ret = 0;
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+		if (!cqe->user_data)
+			continue;
+
+		if (r->stash_len == r->stash_size) {
+			unsigned int size = r->stash_size ? r->stash_size * 2 : 64;
+			struct io_uring_cqe *stash = realloc(r->stash, size * sizeof(*stash));
+
+			if (!stash) {
+				ret = -1;
+				break;
+			}
+
+			r->stash = stash;
+			r->stash_size = size;
+		}
+
+		r->stash[r->stash_len++] = *cqe;
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+	return ret;
+}
+
+/* drops completions for fd, returns true if there were any */
+static bool _uloop_io_uring_forget(struct uloop_io_uring *r, struct uloop_fd *fd){
+	unsigned int i, tail;
+	bool found = false;
+
+	for (i = 0; i < r->stash_len; i++) {
+		if (r->stash[i].user_data != (uintptr_t)fd)
+			continue;
+
+		r->stash[i].user_data = 0;
+		found = true;
+	}
+
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (i = *r->cq_head; i != tail; i++) {
+		struct io_uring_cqe *cqe = &r->cqes[i & *r->cq_mask];
+
+		if (cqe->user_data != (uintptr_t)fd)
+			continue;
+
+		cqe->user_data = 0;
+		found = true;
+	}
+
+	return found;
+}
+
+static int _uloop_io_uring_unregister_fd(struct uloop *self, struct uloop_fd *fd){
+	struct uloop_io_uring *r = self->ring;
+	unsigned int i;
+
+	if (!(fd->flags & ULOOP_POLL_ARMED))
+		return 0;
+
+	fd->flags &= ~ULOOP_POLL_ARMED;
+
+	/* a poll that has not been submitted yet is simply dropped */
+	for (i = *r->sq_head; i != r->sq_local_tail; i++) {
+		struct io_uring_sqe *sqe = &r->sqes[i & *r->sq_mask];
+
+		if (sqe->opcode != IORING_OP_POLL_ADD || sqe->user_data != (uintptr_t)fd)
+			continue;
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_NOP;
+		return 0;
+	}
+
+	/*
+	 * The poll is in flight and will post exactly one more completion.
+	 * Cancel it and wait for that completion so that nothing refers to fd
+	 * once it has been removed from the loop.
+	 */
+	if (_uloop_io_uring_cancel(self, fd) < 0)
+		return -1;
+
+	if (_uloop_io_uring_submit(self, 0, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		return -1;
+
+	while (!_uloop_io_uring_forget(r, fd)) {
+		if (_uloop_io_uring_stash(r) < 0)
+			return -1;
+
+		if (_uloop_io_uring_submit(self, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* turns a poll completion into an event for the loop, returns false if there is none */
+static bool _uloop_io_uring_reap(struct uloop *self, struct io_uring_cqe *cqe, struct uloop_fd_event *cur){
+	struct uloop_fd *u = (struct uloop_fd *)(uintptr_t)cqe->user_data;
+	unsigned int mask, ev = 0;
+
+	if (!u)
+		return false;
+
+	u->flags &= ~ULOOP_POLL_ARMED;
+
+	/*
+	 * a poll armed with older flags can complete before its cancel
+	 * is processed, drop what the fd is no longer interested in
+	 */
+	if (cqe->res == -ECANCELED)
+		mask = 0;
+	else if (cqe->res < 0)
+		mask = POLLERR;
+	else
+		mask = cqe->res & (_uloop_io_uring_poll_mask(u->flags) | POLLERR | POLLHUP | POLLNVAL);
+
+	if (mask & (POLLERR | POLLHUP | POLLNVAL)) {
+		u->error = true;
+		if (mask & POLLHUP)
+			u->hangup = true;
+		if (!(u->flags & ULOOP_ERROR_CB))
+			uloop_remove_fd(self, u);
+	}
+
+	/* submitted along with the next wait, after this batch has been handled */
+	if (u->registered && !(u->flags & ULOOP_POLL_ARMED))
+		_uloop_io_uring_arm(self, u);
+
+	if (!mask)
+		return false;
+
+	if (mask & POLLRDHUP)
+		u->eof = true;
+
+	if (mask & POLLIN)
+		ev |= ULOOP_READ;
+
+	if (mask & POLLOUT)
+		ev |= ULOOP_WRITE;
+
+	cur->fd = u;
+	cur->events = ev;
+	return true;
+}
+
+static int _uloop_io_uring_fetch_events(struct uloop *self, int timeout){
+	struct uloop_io_uring *r = self->ring;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned int i, head, tail;
+	int nfds = 0;
+
+	memset(&arg, 0, sizeof(arg));
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		arg.ts = (uintptr_t)&ts;
+	}
+
+	/* completions left over from the last call mean there is no need to wait */
+	if (r->stash_len || *r->cq_head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		timeout = 0;
+
+	if (_uloop_io_uring_submit(self, timeout ? 1 : 0,
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 &&
+	    errno != ETIME && errno != EINTR)
+		return -1;
+
+	for (i = 0; i < r->stash_len && nfds < self->max_events; i++) {
+		if (_uloop_io_uring_reap(self, &r->stash[i], &self->cur_fds[nfds]))
+			nfds++;
+	}
+
+	/* stash is NULL until the ring first overflowed */
+	r->stash_len -= i;
+	if (r->stash_len)
+		memmove(r->stash, r->stash + i, r->stash_len * sizeof(*r->stash));
+
+	head = *r->cq_head;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail && nfds < self->max_events; head++) {
+		if (_uloop_io_uring_reap(self, &r->cqes[head & *r->cq_mask], &self->cur_fds[nfds]))
+			nfds++;
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+	return nfds;
+}
+
+const struct uloop_backend uloop_io_uring_backend = {
+	.name = "io_uring",
+	.init = _uloop_io_uring_init,
+	.destroy = _uloop_io_uring_destroy,
+	.register_fd = _uloop_io_uring_register_fd,
+	.unregister_fd = _uloop_io_uring_unregister_fd,
+	.fetch_events = _uloop_io_uring_fetch_events,
+};
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * uloop_listener - batched accept on SO_REUSEPORT listening sockets
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "uloop_listener.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+static void _uloop_listener_cb(struct uloop_fd *fd, unsigned int events){
+	struct uloop_listener *l = container_of(fd, struct uloop_listener, fd);
+	int batch = l->accept_batch > 0 ? l->accept_batch : ULOOP_LISTENER_BATCH;
+	int sock;
+
+	/* the fd is level triggered, whatever is left over fires again */
+	while (batch-- > 0) {
+		sock = accept4(fd->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			/* EAGAIN, or out of fds / memory: try again on the next event */
+			break;
+		}
+
+		l->cb(l, sock);
+
+		/* the callback may have removed the listener */
+		if (!fd->registered)
+			break;
+	}
+}
+
+int uloop_listener_open(struct uloop_listener *l, int type, const char *host, const char *service){
+	memset(&l->fd, 0, sizeof(l->fd));
+	l->fd.cb = _uloop_listener_cb;
+	l->fd.fd = usock(type | USOCK_SERVER | USOCK_REUSEPORT | USOCK_NONBLOCK, host, service);
+	if (l->fd.fd < 0)
+		return -1;
+
+	return 0;
+}
+
+int uloop_listener_steer_cpu(struct uloop_listener *l, int nsockets){
+	struct sock_filter code[] = {
+		/* A = cpu the packet arrived on */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		/* A = A % nsockets */
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nsockets },
+		/* return A */
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	if (nsockets <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return setsockopt(l->fd.fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int uloop_listener_add(struct uloop *self, struct uloop_listener *l){
+	l->loop = self;
+	return uloop_add_fd(self, &l->fd, ULOOP_READ);
+}
+
+int uloop_listener_remove(struct uloop *self, struct uloop_listener *l){
+	if (l->fd.fd < 0)
+		return -1;
+
+	uloop_remove_fd(self, &l->fd);
+	close(l->fd.fd);
+	l->fd.fd = -1;
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * uloop_listener - batched accept on SO_REUSEPORT listening sockets
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include "uloop.h"
+#include "usock.h"
+
+/* default number of connections accepted per readiness event */
+#define ULOOP_LISTENER_BATCH 16
+
+struct uloop_listener;
+
+/* called on the listener's loop with a non blocking, close-on-exec socket */
+typedef void (*uloop_listener_handler)(struct uloop_listener *l, int fd);
+
+/*
+ * A listener owns one listening socket. Listeners opened with
+ * USOCK_REUSEPORT on the same address form a group in which the kernel
+ * spreads incoming connections, so every loop can accept its own share
+ * without a shared acceptor.
+ */
+struct uloop_listener {
+	struct uloop_fd fd;
+	struct uloop *loop;
+
+	uloop_listener_handler cb;
+
+	/* accept4() calls per readiness event (default: ULOOP_LISTENER_BATCH) */
+	int accept_batch;
+};
+
+/*
+ * uloop_listener_open: open the listening socket, type is passed on to
+ * usock() with USOCK_SERVER, USOCK_REUSEPORT and USOCK_NONBLOCK added
+ */
+int uloop_listener_open(struct uloop_listener *l, int type, const char *host, const char *service);
+
+/*
+ * uloop_listener_steer_cpu: steer connections of the SO_REUSEPORT group l
+ * belongs to by the cpu they arrive on: cpu n goes to the n-th socket
+ * (modulo nsockets) opened in the group. only useful if the loop owning
+ * the n-th socket runs on cpu n.
+ */
+int uloop_listener_steer_cpu(struct uloop_listener *l, int nsockets);
+
+/* uloop_listener_add: start accepting on the loop's thread */
+int uloop_listener_add(struct uloop *self, struct uloop_listener *l);
+
+/* uloop_listener_remove: stop accepting and close the listening socket */
+int uloop_listener_remove(struct uloop *self, struct uloop_listener *l);
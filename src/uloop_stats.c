@@ -0,0 +1,82 @@
+/*
+ * uloop_stats - event loop latency histograms
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <string.h>
+
+#include "uloop.h"
+#include "uloop_stats.h"
+
+static void _uloop_histogram_copy(struct uloop_histogram *dst, const struct uloop_histogram *src){
+	int i;
+
+	dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	for (i = 0; i < ULOOP_HIST_BUCKETS; i++)
+		dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+}
+
+int uloop_stats_get(struct uloop *self, struct uloop_stats *stats){
+	if (!self->stats) {
+		memset(stats, 0, sizeof(*stats));
+		return -1;
+	}
+
+	_uloop_histogram_copy(&stats->callback_ns, &self->stats->callback_ns);
+	_uloop_histogram_copy(&stats->sleep_ns, &self->stats->sleep_ns);
+	_uloop_histogram_copy(&stats->events, &self->stats->events);
+	_uloop_histogram_copy(&stats->timer_late_ns, &self->stats->timer_late_ns);
+
+	return 0;
+}
+
+uint64_t uloop_histogram_percentile(const struct uloop_histogram *h, double p){
+	uint64_t total = 0, want, mant;
+	int i, shift;
+
+	if (!h->count)
+		return 0;
+
+	/* the bucket counts are authoritative, count may be a bit off in a copy */
+	for (i = 0; i < ULOOP_HIST_BUCKETS; i++)
+		total += h->buckets[i];
+
+	want = (uint64_t)(total * (p / 100.0) + 0.5);
+	if (want < 1)
+		want = 1;
+
+	for (i = 0; i < ULOOP_HIST_BUCKETS; i++) {
+		if (h->buckets[i] >= want)
+			break;
+		want -= h->buckets[i];
+	}
+
+	if (i >= ULOOP_HIST_BUCKETS)
+		return h->max;
+
+	if (i < ULOOP_HIST_SUB_SIZE)
+		return i;
+
+	shift = (i >> ULOOP_HIST_SUB_BITS) - 1;
+	mant = (i & (ULOOP_HIST_SUB_SIZE - 1)) | ULOOP_HIST_SUB_SIZE;
+
+	/* the last bucket's upper bound does not fit, max is exact anyway */
+	if (((mant + 1) << shift) - 1 > h->max)
+		return h->max;
+
+	return ((mant + 1) << shift) - 1;
+}
@@ -0,0 +1,88 @@
+/*
+ * uloop_stats - event loop latency histograms
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <stdint.h>
+
+struct uloop;
+
+/*
+ * Histograms are log-linear like HdrHistogram: values below
+ * ULOOP_HIST_SUB_SIZE have a bucket each, above that every power of two
+ * is split into ULOOP_HIST_SUB_SIZE buckets, so a bucket is never wider
+ * than 1/ULOOP_HIST_SUB_SIZE of the values it holds.
+ */
+#define ULOOP_HIST_SUB_BITS	3
+#define ULOOP_HIST_SUB_SIZE	(1 << ULOOP_HIST_SUB_BITS)
+#define ULOOP_HIST_BUCKETS	((64 - ULOOP_HIST_SUB_BITS + 1) << ULOOP_HIST_SUB_BITS)
+
+struct uloop_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[ULOOP_HIST_BUCKETS];
+};
+
+struct uloop_stats {
+	/* run time of fd and timeout callbacks (ns) */
+	struct uloop_histogram callback_ns;
+	/* time spent waiting in the backend, busy polling included (ns) */
+	struct uloop_histogram sleep_ns;
+	/* number of events returned by one wait */
+	struct uloop_histogram events;
+	/* how late timeouts fire compared to their deadline (ns) */
+	struct uloop_histogram timer_late_ns;
+};
+
+/*
+ * uloop_stats_get: copy the loop's histograms into stats
+ *
+ * may be called from any thread while the loop runs, the copy is not an
+ * atomic snapshot across buckets. returns -1 if the library was built
+ * without --enable-stats.
+ */
+int uloop_stats_get(struct uloop *self, struct uloop_stats *stats);
+
+/* uloop_histogram_percentile: upper bound of the bucket holding percentile p (0-100) */
+uint64_t uloop_histogram_percentile(const struct uloop_histogram *h, double p);
+
+static inline unsigned int _uloop_histogram_bucket(uint64_t v){
+	int shift;
+
+	if (v < ULOOP_HIST_SUB_SIZE)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - ULOOP_HIST_SUB_BITS;
+	return ((shift + 1) << ULOOP_HIST_SUB_BITS) + ((v >> shift) & (ULOOP_HIST_SUB_SIZE - 1));
+}
+
+/*
+ * internal: record a value from the loop thread. there is a single writer
+ * per histogram, so plain increments published with relaxed stores are
+ * enough for readers on other threads.
+ */
+static inline void _uloop_histogram_record(struct uloop_histogram *h, int64_t value){
+	uint64_t v = value > 0 ? value : 0;
+	unsigned int b = _uloop_histogram_bucket(v);
+
+	__atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+	if (v > h->max)
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
@@ -10,12 +10,77 @@ void clock_monotonic(struct timeval *tv){
 	tv->tv_usec = ts.tv_nsec / 1000;
 }
 
+int64_t clock_monotonic_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+
+#define UTICK_HAVE_TSC
+
+/* utick = tick_base + ((tsc - tsc_base) * mult >> 32) */
+static struct {
+	bool enabled;
+	uint64_t tsc_base;
+	utick_t tick_base;
+	uint64_t mult;
+} _utick_tsc;
+
+static inline utick_t _utick_tsc_now(void){
+	uint64_t delta = __rdtsc() - _utick_tsc.tsc_base;
+
+	return _utick_tsc.tick_base + (utick_t)(((unsigned __int128)delta * _utick_tsc.mult) >> 32);
+}
+#endif
+
+int utick_use_tsc(bool enable){
+#ifdef UTICK_HAVE_TSC
+	unsigned int eax, ebx, ecx, edx;
+	struct timespec delay = { .tv_nsec = 20000000 };
+	int64_t t0, t1;
+	uint64_t c0, c1;
+
+	if (!enable) {
+		_utick_tsc.enabled = false;
+		return 0;
+	}
+
+	/* the counter must tick at a constant rate across p- and c-states */
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+		return -1;
+
+	t0 = clock_monotonic_ns();
+	c0 = __rdtsc();
+	nanosleep(&delay, NULL);
+	t1 = clock_monotonic_ns();
+	c1 = __rdtsc();
+
+	if (c1 <= c0 || t1 <= t0)
+		return -1;
+
+	_utick_tsc.mult = (uint64_t)(((unsigned __int128)(t1 - t0) << 32) / ((unsigned __int128)(c1 - c0) * 1000));
+	_utick_tsc.tsc_base = c1;
+	_utick_tsc.tick_base = t1 / 1000;
+	_utick_tsc.enabled = true;
+
+	return 0;
+#else
+	return enable ? -1 : 0;
+#endif
+}
+
 utick_t utick_now(void){
-	struct timeval time;
+#ifdef UTICK_HAVE_TSC
+	if (_utick_tsc.enabled)
+		return _utick_tsc_now();
+#endif
 
-	clock_monotonic(&time);
-	
-	return ((utick_t)time.tv_sec) * 1000000L + time.tv_usec; 
+	return clock_monotonic_ns() / 1000; 
 }
 
 int uloop_timeout_set(struct uloop_timeout *self, int msecs){
@@ -25,6 +90,7 @@ int uloop_timeout_set(struct uloop_timeout *self, int msecs){
 		return -1; 
 		//uloop_remove_timeout(self->loop, self);
 
+	self->hires = false;
 	clock_monotonic(time);
 
 	time->tv_sec += msecs / 1000;
@@ -40,6 +106,19 @@ int uloop_timeout_set(struct uloop_timeout *self, int msecs){
 	//return uloop_add_timeout(self->loop, self);
 }
 
+int uloop_timeout_set_ns(struct uloop_timeout *self, int64_t nsecs){
+	if (self->pending)
+		return -1; 
+
+	self->hires = true;
+	self->expires_ns = clock_monotonic_ns() + nsecs;
+
+	/* keep the millisecond view for uloop_timeout_remaining() and friends */
+	_ns_tv(self->expires_ns, &self->time);
+
+	return 0; 
+}
+
 int uloop_timeout_cancel(struct uloop_timeout *self){
 	if (!self->pending)
 		return -1;
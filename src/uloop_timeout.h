@@ -16,17 +16,56 @@ struct uloop_timeout
 
 	uloop_timeout_handler cb;
 	struct timeval time;
+	/* expiry in milliseconds, set when the timeout is added to a loop */
+	int64_t expires;
+
+	/*
+	 * how late (in ms) the timeout may fire so it can share a wakeup with
+	 * others, 0 fires it as close to its deadline as possible
+	 */
+	int slack;
+
+	/* set by uloop_timeout_set_ns(): fire at expires_ns instead of time */
+	bool hires;
+	int64_t expires_ns;
 };
 
 typedef int64_t utick_t; 
+/* utick_now: monotonic time in microseconds */
 utick_t utick_now(void); 
+/*
+ * utick_use_tsc: serve utick_now() from the cpu's time stamp counter
+ *
+ * the counter is calibrated against CLOCK_MONOTONIC when enabled, so the
+ * two drift apart by the calibration error. only available with an
+ * invariant TSC on x86_64, returns -1 otherwise. not thread safe, call it
+ * before starting threads that use utick_now().
+ */
+int utick_use_tsc(bool enable); 
 static inline bool utick_expired(utick_t t) { return (t - utick_now()) < 0; }
 
 void clock_monotonic(struct timeval *tv); 
+int64_t clock_monotonic_ns(void); 
 int uloop_timeout_set(struct uloop_timeout *timeout, int msecs);
+/*
+ * uloop_timeout_set_ns: like uloop_timeout_set() with nanosecond resolution
+ *
+ * such timeouts are kept apart from the millisecond wheel and fire from a
+ * per-loop timerfd, so they are not rounded to the next millisecond.
+ */
+int uloop_timeout_set_ns(struct uloop_timeout *timeout, int64_t nsecs);
 int uloop_timeout_cancel(struct uloop_timeout *timeout);
 int uloop_timeout_remaining(struct uloop_timeout *timeout);
 
+static inline int64_t _tv_ms(struct timeval *tv){
+	return (int64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000;
+}
+
+static inline void _ns_tv(int64_t ns, struct timeval *tv){
+	tv->tv_sec = ns / 1000000000LL;
+	tv->tv_usec = (ns % 1000000000LL) / 1000;
+}
+
 static inline int _tv_diff(struct timeval *t1, struct timeval *t2){
 	return
 		(t1->tv_sec - t2->tv_sec) * 1000 +
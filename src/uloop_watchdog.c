@@ -0,0 +1,219 @@
+/*
+ * uloop_watchdog - report callbacks that stall an event loop
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <execinfo.h>
+
+#include "uloop_watchdog.h"
+#include "ulog.h"
+
+/* one backtrace is taken at a time, the handler fills in the target */
+static pthread_mutex_t _uloop_watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct uloop_watchdog *_uloop_watchdog_target;
+static pthread_once_t _uloop_watchdog_once = PTHREAD_ONCE_INIT;
+static bool _uloop_watchdog_have_signal;
+
+static void _uloop_watchdog_signal(int signo){
+	struct uloop_watchdog *wd = __atomic_load_n(&_uloop_watchdog_target, __ATOMIC_ACQUIRE);
+	int err = errno;
+
+	if (wd && pthread_equal(pthread_self(), __atomic_load_n(&wd->loop_thread, __ATOMIC_RELAXED))) {
+		wd->nframes = backtrace(wd->frames, ULOOP_WATCHDOG_FRAMES);
+		sem_post(&wd->done);
+	}
+
+	errno = err;
+}
+
+static void _uloop_watchdog_setup_signal(void){
+	struct sigaction sa;
+	void *frame;
+
+	/* the first backtrace() may load libgcc, never do that in the handler */
+	backtrace(&frame, 1);
+
+	sigaction(ULOOP_WATCHDOG_SIGNAL, NULL, &sa);
+	if (sa.sa_handler != SIG_DFL) /* Do not override existing custom signal handlers */
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _uloop_watchdog_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	_uloop_watchdog_have_signal = !sigaction(ULOOP_WATCHDOG_SIGNAL, &sa, NULL);
+}
+
+static int _uloop_watchdog_backtrace(struct uloop_watchdog *wd){
+	struct timespec ts;
+	int nframes = 0;
+	int ret;
+
+	if (!_uloop_watchdog_have_signal)
+		return 0;
+
+	pthread_mutex_lock(&_uloop_watchdog_lock);
+
+	/* a late answer to an earlier request must not count for this one */
+	while (!sem_trywait(&wd->done))
+		;
+
+	__atomic_store_n(&_uloop_watchdog_target, wd, __ATOMIC_RELEASE);
+	if (!pthread_kill(__atomic_load_n(&wd->loop_thread, __ATOMIC_RELAXED), ULOOP_WATCHDOG_SIGNAL)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		do {
+			ret = sem_timedwait(&wd->done, &ts);
+		} while (ret < 0 && errno == EINTR);
+
+		if (!ret)
+			nframes = wd->nframes;
+	}
+	__atomic_store_n(&_uloop_watchdog_target, NULL, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&_uloop_watchdog_lock);
+
+	return nframes;
+}
+
+static void _uloop_watchdog_check(struct uloop_watchdog *wd){
+	int64_t start, now;
+	uint64_t seq;
+	void *cb, *obj;
+	char **symbols;
+	int fd, nframes, i;
+
+	start = __atomic_load_n(&wd->start, __ATOMIC_ACQUIRE);
+	if (!start)
+		return;
+
+	seq = __atomic_load_n(&wd->seq, __ATOMIC_RELAXED);
+	if (seq == wd->reported)
+		return;
+
+	now = clock_monotonic_ns();
+	if (now - start < wd->threshold)
+		return;
+
+	cb = __atomic_load_n(&wd->cb, __ATOMIC_RELAXED);
+	obj = __atomic_load_n(&wd->obj, __ATOMIC_RELAXED);
+	fd = __atomic_load_n(&wd->fd, __ATOMIC_RELAXED);
+
+	/* the loop moved on while we looked, the fields may be mixed up */
+	if (__atomic_load_n(&wd->start, __ATOMIC_ACQUIRE) != start ||
+	    __atomic_load_n(&wd->seq, __ATOMIC_RELAXED) != seq)
+		return;
+
+	wd->reported = seq;
+	nframes = _uloop_watchdog_backtrace(wd);
+
+	if (fd >= 0)
+		ULOG_WARN("uloop: callback %p for fd %d stalled the loop for %lld ms\n",
+			  cb, fd, (long long)((now - start) / 1000000));
+	else
+		ULOG_WARN("uloop: callback %p for %p stalled the loop for %lld ms\n",
+			  cb, obj, (long long)((now - start) / 1000000));
+
+	symbols = nframes ? backtrace_symbols(wd->frames, nframes) : NULL;
+	for (i = 0; symbols && i < nframes; i++)
+		ULOG_WARN("uloop:   #%d %s\n", i, symbols[i]);
+	free(symbols);
+}
+
+static void *_uloop_watchdog_thread(void *arg){
+	struct uloop_watchdog *wd = arg;
+	struct timespec ts;
+	int64_t next;
+
+	pthread_mutex_lock(&wd->lock);
+	while (!wd->stop) {
+		next = clock_monotonic_ns() + wd->threshold / 2;
+		ts.tv_sec = next / 1000000000LL;
+		ts.tv_nsec = next % 1000000000LL;
+		pthread_cond_timedwait(&wd->cond, &wd->lock, &ts);
+		if (wd->stop)
+			break;
+
+		pthread_mutex_unlock(&wd->lock);
+		_uloop_watchdog_check(wd);
+		pthread_mutex_lock(&wd->lock);
+	}
+	pthread_mutex_unlock(&wd->lock);
+
+	return NULL;
+}
+
+int uloop_watchdog_start(struct uloop *self, int threshold_ms){
+	struct uloop_watchdog *wd;
+	pthread_condattr_t attr;
+
+	if (self->watchdog || threshold_ms <= 0)
+		return -1;
+
+	pthread_once(&_uloop_watchdog_once, _uloop_watchdog_setup_signal);
+
+	wd = calloc(1, sizeof(*wd));
+	if (!wd)
+		return -1;
+
+	wd->threshold = (int64_t)threshold_ms * 1000000;
+	wd->fd = -1;
+	wd->loop_thread = pthread_self();
+	sem_init(&wd->done, 0, 0);
+	pthread_mutex_init(&wd->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wd->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&wd->thread, NULL, _uloop_watchdog_thread, wd)) {
+		pthread_cond_destroy(&wd->cond);
+		pthread_mutex_destroy(&wd->lock);
+		sem_destroy(&wd->done);
+		free(wd);
+		return -1;
+	}
+
+	self->watchdog = wd;
+	return 0;
+}
+
+void uloop_watchdog_stop(struct uloop *self){
+	struct uloop_watchdog *wd = self->watchdog;
+
+	if (!wd)
+		return;
+
+	pthread_mutex_lock(&wd->lock);
+	wd->stop = true;
+	pthread_cond_signal(&wd->cond);
+	pthread_mutex_unlock(&wd->lock);
+	pthread_join(wd->thread, NULL);
+
+	pthread_cond_destroy(&wd->cond);
+	pthread_mutex_destroy(&wd->lock);
+	sem_destroy(&wd->done);
+	free(wd);
+	self->watchdog = NULL;
+}
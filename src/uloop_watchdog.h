@@ -0,0 +1,121 @@
+/*
+ * uloop_watchdog - report callbacks that stall an event loop
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+
+#include "uloop.h"
+
+/* signal used to take a backtrace of a stalled loop thread */
+#ifndef ULOOP_WATCHDOG_SIGNAL
+#define ULOOP_WATCHDOG_SIGNAL	(SIGRTMIN + 4)
+#endif
+
+#define ULOOP_WATCHDOG_FRAMES	32
+
+/*
+ * The loop publishes the fd, timeout or deferred callback it is running, a
+ * watchdog thread checks every threshold / 2 whether the same callback is
+ * still running after threshold and reports it once through ulog, together
+ * with a backtrace of the loop thread. Link with -rdynamic to get symbol
+ * names. The backtrace signal is handled with SA_RESTART, calls that are
+ * never restarted (sleeps, poll, ...) return EINTR in the stalled callback.
+ */
+struct uloop_watchdog {
+	pthread_t thread;
+	int64_t threshold;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+
+	/* written by the loop thread around every callback */
+	pthread_t loop_thread;
+	int64_t start;
+	uint64_t seq;
+	void *cb;
+	void *obj;
+	int fd;
+
+	/* callbacks entered so far, only used by the loop thread */
+	uint64_t entered;
+
+	/* last seq that was reported, only used by the watchdog thread */
+	uint64_t reported;
+
+	/* filled in on the loop thread by the ULOOP_WATCHDOG_SIGNAL handler */
+	void *frames[ULOOP_WATCHDOG_FRAMES];
+	int nframes;
+	sem_t done;
+};
+
+/*
+ * uloop_watchdog_start: report callbacks of this loop that run longer than
+ * threshold_ms. the backtrace signal handler is only installed if the
+ * signal has no handler yet, otherwise reports come without a backtrace.
+ */
+int uloop_watchdog_start(struct uloop *self, int threshold_ms);
+void uloop_watchdog_stop(struct uloop *self);
+
+/*
+ * internal: the callback that was running when another one was entered, a
+ * callback that runs the loop itself is watched again once the nested one
+ * returns. zeroed, it stands for no callback at all.
+ */
+struct uloop_watchdog_frame {
+	int64_t start;
+	uint64_t seq;
+	void *cb;
+	void *obj;
+	int fd;
+};
+
+static inline void _uloop_watchdog_publish(struct uloop_watchdog *wd, const struct uloop_watchdog_frame *f){
+	/* the watchdog thread must not see the new start with the old fields */
+	__atomic_store_n(&wd->start, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&wd->cb, f->cb, __ATOMIC_RELAXED);
+	__atomic_store_n(&wd->obj, f->obj, __ATOMIC_RELAXED);
+	__atomic_store_n(&wd->fd, f->fd, __ATOMIC_RELAXED);
+	__atomic_store_n(&wd->seq, f->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&wd->start, f->start, __ATOMIC_RELEASE);
+}
+
+/* internal: called by the loop around fd, timeout and deferred callbacks */
+static inline void _uloop_watchdog_enter(struct uloop_watchdog *wd, struct uloop_watchdog_frame *prev,
+					 void *cb, void *obj, int fd){
+	struct uloop_watchdog_frame f = {
+		.start = clock_monotonic_ns(),
+		.seq = ++wd->entered,
+		.cb = cb,
+		.obj = obj,
+		.fd = fd,
+	};
+
+	prev->start = wd->start;
+	prev->seq = wd->seq;
+	prev->cb = wd->cb;
+	prev->obj = wd->obj;
+	prev->fd = wd->fd;
+	_uloop_watchdog_publish(wd, &f);
+}
+
+static inline void _uloop_watchdog_leave(struct uloop_watchdog *wd, const struct uloop_watchdog_frame *prev){
+	_uloop_watchdog_publish(wd, prev);
+}
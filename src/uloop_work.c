@@ -0,0 +1,293 @@
+/*
+ * uloop_work - offload blocking or cpu heavy work from event loops
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "uloop_work.h"
+
+struct uloop_work {
+	/* must come first, the loop frees the job once done() has run */
+	struct uloop_post_task post;
+
+	uloop_work_handler work;
+	struct uloop *loop;
+};
+
+struct uloop_work_queue {
+	pthread_mutex_t lock;
+	struct uloop_work **jobs;
+	/* tail - head is the number of queued jobs */
+	unsigned int head, tail;
+	unsigned int size;
+
+	struct uloop_work_pool *pool;
+	int idx;
+};
+
+struct uloop_work_pool {
+	struct uloop_work_queue *queues;
+	pthread_t *threads;
+	int nthreads;
+
+	/* idle workers sleep on cond until queued becomes non zero */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int queued;
+	int idle;
+	bool stop;
+
+	/* round robin position for uloop_work_submit() */
+	unsigned int next;
+};
+
+static bool _uloop_work_push(struct uloop_work_queue *q, struct uloop_work *w){
+	bool ret = false;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->tail - q->head < q->size) {
+		q->jobs[q->tail++ % q->size] = w;
+		ret = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+static struct uloop_work *_uloop_work_pop(struct uloop_work_queue *q){
+	struct uloop_work *w = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->tail != q->head)
+		w = q->jobs[q->head++ % q->size];
+	pthread_mutex_unlock(&q->lock);
+
+	return w;
+}
+
+static void *_uloop_work_thread(void *arg){
+	struct uloop_work_queue *q = arg;
+	struct uloop_work_pool *pool = q->pool;
+	struct uloop_work *w;
+	int i;
+
+	while (1) {
+		/* a stopping pool leaves the jobs that did not start to delete */
+		if (__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST))
+			break;
+
+		/* own queue first, then steal from the others */
+		w = _uloop_work_pop(q);
+		for (i = 1; !w && i < pool->nthreads; i++)
+			w = _uloop_work_pop(&pool->queues[(q->idx + i) % pool->nthreads]);
+
+		if (w) {
+			__atomic_fetch_sub(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+			w->work(w->post.arg);
+			if (w->post.cb)
+				uloop_post_task(w->loop, &w->post);
+			else
+				free(w);
+			continue;
+		}
+
+		/*
+		 * submitters bump queued before checking idle, so either we see
+		 * their job here or they see us idle and signal
+		 */
+		pthread_mutex_lock(&pool->lock);
+		__atomic_fetch_add(&pool->idle, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) && !pool->stop)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		__atomic_fetch_sub(&pool->idle, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+struct uloop_work_pool *uloop_work_pool_new(int nthreads, int max_queued){
+	struct uloop_work_pool *self;
+	unsigned int size;
+	int i;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	if (max_queued <= 0)
+		max_queued = ULOOP_WORK_MAX_QUEUED;
+	size = (max_queued + nthreads - 1) / nthreads;
+
+	self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+
+	self->queues = calloc(nthreads, sizeof(*self->queues));
+	self->threads = calloc(nthreads, sizeof(*self->threads));
+	if (!self->queues || !self->threads)
+		goto fail;
+
+	for (i = 0; i < nthreads; i++) {
+		struct uloop_work_queue *q = &self->queues[i];
+
+		q->jobs = calloc(size, sizeof(*q->jobs));
+		if (!q->jobs)
+			goto fail;
+
+		pthread_mutex_init(&q->lock, NULL);
+		q->size = size;
+		q->pool = self;
+		q->idx = i;
+	}
+
+	/* workers look at every queue, so they are only started once all exist */
+	self->nthreads = nthreads;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&self->threads[i], NULL, _uloop_work_thread, &self->queues[i]))
+			break;
+	}
+
+	if (i < nthreads) {
+		int started = i;
+
+		pthread_mutex_lock(&self->lock);
+		__atomic_store_n(&self->stop, true, __ATOMIC_SEQ_CST);
+		pthread_cond_broadcast(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+
+		for (i = 0; i < started; i++)
+			pthread_join(self->threads[i], NULL);
+		goto fail;
+	}
+
+	return self;
+
+fail:
+	if (self->queues) {
+		for (i = 0; i < nthreads; i++) {
+			if (self->queues[i].jobs)
+				pthread_mutex_destroy(&self->queues[i].lock);
+			free(self->queues[i].jobs);
+		}
+	}
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	free(self->queues);
+	free(self->threads);
+	free(self);
+	return NULL;
+}
+
+void uloop_work_pool_delete(struct uloop_work_pool **self){
+	struct uloop_work_pool *pool;
+	struct uloop_work *w;
+	int i;
+
+	assert(self);
+	pool = *self;
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_store_n(&pool->stop, true, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	/* only waits for the jobs that are running right now */
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	/* the rest never started, so their done callback is not posted */
+	for (i = 0; i < pool->nthreads; i++) {
+		while ((w = _uloop_work_pop(&pool->queues[i])))
+			free(w);
+
+		pthread_mutex_destroy(&pool->queues[i].lock);
+		free(pool->queues[i].jobs);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->queues);
+	free(pool->threads);
+	free(pool);
+	*self = NULL;
+}
+
+void uloop_set_work_pool(struct uloop *self, struct uloop_work_pool *pool){
+	if (self->work_pool_owned)
+		uloop_work_pool_delete(&self->work_pool);
+
+	self->work_pool = pool;
+	self->work_pool_owned = false;
+}
+
+int uloop_work_submit(struct uloop *self, uloop_work_handler work, uloop_work_handler done, void *arg){
+	struct uloop_work_pool *pool = self->work_pool;
+	struct uloop_work *w;
+	unsigned int start;
+	int i;
+
+	if (!pool) {
+		pool = uloop_work_pool_new(0, 0);
+		if (!pool)
+			return -1;
+
+		self->work_pool = pool;
+		self->work_pool_owned = true;
+	}
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return -1;
+
+	w->post.cb = done;
+	w->post.arg = arg;
+	w->work = work;
+	w->loop = self;
+
+	/* counted before the push so a worker can never see queued drop below 0 */
+	__atomic_fetch_add(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+	start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < pool->nthreads; i++) {
+		if (_uloop_work_push(&pool->queues[(start + i) % pool->nthreads], w))
+			break;
+	}
+
+	if (i == pool->nthreads) {
+		__atomic_fetch_sub(&pool->queued, 1, __ATOMIC_SEQ_CST);
+		free(w);
+		return -1;
+	}
+
+	if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * uloop_work - offload blocking or cpu heavy work from event loops
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include "uloop.h"
+
+/* default number of jobs a pool accepts before uloop_work_submit() fails */
+#define ULOOP_WORK_MAX_QUEUED 1024
+
+typedef void (*uloop_work_handler)(void *arg);
+
+/*
+ * A work pool runs jobs on a fixed set of worker threads, so at most
+ * nthreads jobs of a pool run at the same time. Every worker has its own
+ * bounded queue and steals from the others when its own queue is empty.
+ * A pool can be shared by several loops.
+ */
+struct uloop_work_pool;
+
+/*
+ * uloop_work_pool_new: start nthreads workers (nthreads <= 0: one per
+ * online cpu) accepting up to max_queued jobs (<= 0: ULOOP_WORK_MAX_QUEUED)
+ */
+struct uloop_work_pool *uloop_work_pool_new(int nthreads, int max_queued);
+
+/*
+ * uloop_work_pool_delete: stop and join the workers once their current job
+ * returns. jobs that did not start yet are dropped without calling their
+ * done callback. the loops using the pool must not be deleted before it.
+ */
+void uloop_work_pool_delete(struct uloop_work_pool **self);
+
+/*
+ * uloop_set_work_pool: make the loop submit its work to pool. a loop
+ * without a pool creates a default one of its own on the first submit.
+ */
+void uloop_set_work_pool(struct uloop *self, struct uloop_work_pool *pool);
+
+/*
+ * uloop_work_submit: run work(arg) on a worker thread, then done(arg) on
+ * the thread running the loop
+ *
+ * done may be NULL. returns -1 if the job could not be allocated or the
+ * queues of the pool are full.
+ */
+int uloop_work_submit(struct uloop *self, uloop_work_handler work, uloop_work_handler done, void *arg);
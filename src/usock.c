@@ -53,6 +53,9 @@ static int usock_connect(int type, struct sockaddr *sa, int sa_len, int family,
 	if (server) {
 		const int one = 1;
 		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if ((type & USOCK_REUSEPORT) &&
+		    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+			goto error;
 
 		if (!bind(sock, sa, sa_len) &&
 		    (socktype != SOCK_STREAM || !listen(sock, SOMAXCONN)))
@@ -62,6 +65,7 @@ static int usock_connect(int type, struct sockaddr *sa, int sa_len, int family,
 			return sock;
 	}
 
+error:
 	close(sock);
 	return -1;
 }
@@ -26,6 +26,7 @@
 #define USOCK_NOCLOEXEC		0x0200
 #define USOCK_NONBLOCK		0x0400
 #define USOCK_NUMERIC		0x0800
+#define USOCK_REUSEPORT		0x1000
 #define USOCK_IPV6ONLY		0x2000
 #define USOCK_IPV4ONLY		0x4000
 #define USOCK_UNIX		0x8000
@@ -16,43 +16,64 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
-#include <stdio.h>
-#include <assert.h>
+#include <string.h>
 
 #include "ustream.h"
 
+/* most buffers a single readv fills */
+#define USTREAM_FD_READ_IOV	16
 
-static void ustream_fd_set_read_blocked(struct ustream *s){
-	assert(0); 
-	// TODO: add to uloop properly
-	//ustream_fd_set_uloop(s, false);
+static void ustream_fd_set_uloop(struct ustream *s, bool write){
+	uloop_add_ustream(s->loop, s, write);
 }
 
-static void ustream_fd_set_uloop(struct ustream *self, bool write){
-	fprintf(stderr, "%s: not implemented!\n", __FUNCTION__); 
+static void ustream_fd_set_read_blocked(struct ustream *s){
+	ustream_fd_set_uloop(s, false);
 }
-/*
-static void ustream_fd_delete(struct ustream *self){
-	fprintf(stderr, "%s: not implemented!\n", __FUNCTION__); 
-}*/
 
 static void ustream_fd_read_pending(struct ustream_fd *sf, bool *more){
 	struct ustream *s = &sf->stream;
-	int buflen = 0;
+	int bytes = sf->read_budget, calls = sf->read_budget_calls;
+	struct iovec iov[USTREAM_FD_READ_IOV];
+	bool drained = false;
+	int want = 1, reserved, avail, n, i;
 	ssize_t len;
-	char *buf;
 
 	do {
 		if (s->read_blocked)
 			break;
 
-		buf = ustream_reserve(s, 1, &buflen);
-		if (!buf)
+		if ((sf->read_budget && bytes <= 0) || (sf->read_budget_calls && calls-- <= 0)) {
+			/* a short read emptied the socket, new data brings a new edge */
+			if (!drained)
+				uloop_add_defer(s->loop, &sf->requeue);
+			return;
+		}
+
+		if (sf->read_budget && want > bytes)
+			want = bytes;
+
+		n = ustream_reserve_iov(s, iov, USTREAM_FD_READ_IOV, want);
+		if (!n)
 			break;
 
-		len = read(sf->fd.fd, buf, buflen);
+		for (reserved = 0, i = 0; i < n; i++)
+			reserved += iov[i].iov_len;
+
+		/* buffers come back whole, only the last one can go past want */
+		if (sf->read_budget && reserved > bytes) {
+			iov[n - 1].iov_len -= reserved - bytes;
+			reserved = bytes;
+		}
+
+		len = readv(sf->fd.fd, iov, n);
 		if (len < 0) {
 			if (errno == EINTR)
 				continue;
@@ -71,8 +92,18 @@ static void ustream_fd_read_pending(struct ustream_fd *sf, bool *more){
 			return;
 		}
 
+		drained = len < reserved;
+		bytes -= len;
 		ustream_fill_read(s, len);
 		*more = true;
+
+		/*
+		 * after a read that filled everything it was given, size the next
+		 * one by what is still queued so it can span several buffers
+		 */
+		want = 1;
+		if (!drained)
+			want = ioctl(sf->fd.fd, FIONREAD, &avail) < 0 ? reserved * 2 : avail;
 	} while (1);
 }
 
@@ -108,6 +139,236 @@ static int ustream_fd_write(struct ustream *s, const char *buf, int buflen, bool
 	return ret;
 }
 
+static int ustream_fd_writev(struct ustream *s, const struct iovec *iov, int iovcnt)
+{
+	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
+	ssize_t len, total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	do {
+		len = writev(sf->fd.fd, iov, iovcnt);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		len = 0;
+	}
+
+	/* a short writev means the fd is full, the rest goes out once it is writable */
+	if (len < total)
+		ustream_fd_set_uloop(s, true);
+
+	return len;
+}
+
+static int ustream_fd_sendfile(struct ustream *s, int fd, off_t offset, int len)
+{
+	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
+	ssize_t ret;
+
+	if (!len)
+		return 0;
+
+	do {
+		ret = sendfile(sf->fd.fd, fd, &offset, len);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		ret = 0;
+	} else if (!ret) {
+		/* the file is shorter than the range, it would never complete */
+		return -1;
+	}
+
+	if (ret < len)
+		ustream_fd_set_uloop(s, true);
+
+	return ret;
+}
+
+/*
+ * every MSG_ZEROCOPY send gets the next number of a per socket sequence,
+ * completions report ranges of those numbers. an entry covers the sends
+ * of one or more ranges and releases its data once all of them are
+ * complete. only the newest entry is open for more sends.
+ */
+struct ustream_fd_zc {
+	struct ustream_fd_zc *next;
+	uint32_t seq_start, seq_end;
+	uint32_t completed;
+	bool closed;
+
+	ustream_release_cb release;
+	void *priv;
+};
+
+static void ustream_fd_zerocopy_release(struct ustream_fd *sf, bool all)
+{
+	struct ustream_fd_zc **p = &sf->zc_head, *zc;
+
+	sf->zc_tail = NULL;
+	while ((zc = *p)) {
+		if (!all && (!zc->closed || zc->completed != zc->seq_end - zc->seq_start)) {
+			sf->zc_tail = zc;
+			p = &zc->next;
+			continue;
+		}
+
+		*p = zc->next;
+		if (zc->release)
+			zc->release(&sf->stream, zc->priv);
+		free(zc);
+	}
+}
+
+static void ustream_fd_zerocopy_done(struct ustream_fd *sf, uint32_t lo, uint32_t hi)
+{
+	struct ustream_fd_zc *zc;
+	uint32_t start, end;
+
+	for (zc = sf->zc_head; zc; zc = zc->next) {
+		end = zc->closed ? zc->seq_end : sf->zc_seq;
+		start = (int32_t)(lo - zc->seq_start) > 0 ? lo : zc->seq_start;
+		if ((int32_t)(hi + 1 - end) < 0)
+			end = hi + 1;
+		if ((int32_t)(end - start) > 0)
+			zc->completed += end - start;
+	}
+}
+
+/* completions come in on the error queue, which raises EPOLLERR */
+static void ustream_fd_zerocopy_poll(struct ustream_fd *sf)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sf->fd.fd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno)
+				continue;
+
+			ustream_fd_zerocopy_done(sf, serr->ee_info, serr->ee_data);
+		}
+	}
+
+	ustream_fd_zerocopy_release(sf, false);
+
+	/* only a hangup or a real socket error is one for the stream */
+	if (sf->fd.hangup)
+		return;
+
+	if (!getsockopt(sf->fd.fd, SOL_SOCKET, SO_ERROR, &err, &len) && !err)
+		sf->fd.error = false;
+}
+
+static int ustream_fd_write_zerocopy(struct ustream *s, const char *buf, int buflen,
+				     ustream_release_cb release, void *priv)
+{
+	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
+	struct ustream_fd_zc *zc = sf->zc_tail;
+	ssize_t ret = 0, len;
+
+	/*
+	 * the rest of a range that was partly sent with MSG_ZEROCOPY goes the
+	 * same way however short it is, its release waits for the completions
+	 */
+	if (!zc || zc->closed) {
+		if (buflen < USTREAM_FD_ZEROCOPY_MIN)
+			goto copy;
+
+		zc = calloc(1, sizeof(*zc));
+		if (!zc)
+			goto copy;
+
+		zc->seq_start = sf->zc_seq;
+		if (sf->zc_tail)
+			sf->zc_tail->next = zc;
+		else
+			sf->zc_head = zc;
+		sf->zc_tail = zc;
+	}
+
+	while (ret < buflen) {
+		len = send(sf->fd.fd, buf + ret, buflen - ret, MSG_ZEROCOPY);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			/* out of pinned memory for now, copy this part */
+			if (errno == ENOBUFS) {
+				len = ustream_fd_write(s, buf + ret, buflen - ret, false);
+				if (len < 0)
+					return -1;
+				ret += len;
+				break;
+			}
+
+			return -1;
+		}
+
+		sf->zc_seq++;
+		ret += len;
+	}
+
+	if (ret < buflen) {
+		ustream_fd_set_uloop(s, true);
+		return ret;
+	}
+
+	zc->release = release;
+	zc->priv = priv;
+	zc->seq_end = sf->zc_seq;
+	zc->closed = true;
+	ustream_fd_zerocopy_release(sf, false);
+
+	return ret;
+
+copy:
+	ret = ustream_fd_write(s, buf, buflen, false);
+	if (ret == buflen && release)
+		release(s, priv);
+
+	return ret;
+}
+
+int ustream_fd_set_zerocopy(struct ustream_fd *sf)
+{
+	int on = 1;
+
+	if (setsockopt(sf->fd.fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0)
+		return -1;
+
+	sf->zerocopy = true;
+	sf->stream.write_zerocopy = ustream_fd_write_zerocopy;
+
+	/* keeps the fd registered when the error queue raises EPOLLERR */
+	ustream_fd_set_uloop(&sf->stream, false);
+	return 0;
+}
+
 static bool __ustream_fd_poll(struct ustream_fd *sf, unsigned int events)
 {
 	struct ustream *s = &sf->stream;
@@ -122,6 +383,15 @@ static bool __ustream_fd_poll(struct ustream_fd *sf, unsigned int events)
 			ustream_fd_set_uloop(s, false);
 	}
 
+	if (sf->zerocopy && sf->fd.error)
+		ustream_fd_zerocopy_poll(sf);
+
+	if (sf->fd.error && !s->write_error) {
+		ustream_state_change(s);
+		s->write_error = true;
+		ustream_fd_set_uloop(s, false);
+	}
+
 	return more;
 }
 
@@ -139,25 +409,45 @@ static void ustream_uloop_cb(struct uloop_fd *fd, unsigned int events)
 	__ustream_fd_poll(sf, events);
 }
 
+static void ustream_fd_requeue_cb(struct uloop_defer *d)
+{
+	struct ustream_fd *sf = container_of(d, struct ustream_fd, requeue);
+
+	__ustream_fd_poll(sf, ULOOP_READ);
+}
+
 static void ustream_fd_free(struct ustream *s)
 {
-	//struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
+	struct ustream_fd *sf = container_of(s, struct ustream_fd, stream);
+
+	uloop_remove_defer(s->loop, &sf->requeue);
+	uloop_remove_fd(s->loop, &sf->fd);
 
-	assert(0); 
-	// TODO: implement ability to add fd to uloop but in a proper way
-	//uloop_fd_delete(&sf->fd);
+	/* the kernel holds its own references to pages still in flight */
+	ustream_fd_zerocopy_release(sf, true);
 }
 
-void ustream_fd_init(struct ustream_fd *sf, int fd)
+void ustream_fd_init(struct ustream_fd *sf, struct uloop *loop, int fd)
 {
 	struct ustream *s = &sf->stream;
 
+	if (!s->r.max_buffers)
+		s->r.max_buffers = USTREAM_FD_READ_BUFFERS;
 	ustream_init_defaults(s);
+	s->loop = loop;
 
 	sf->fd.fd = fd;
 	sf->fd.cb = ustream_uloop_cb;
+	memset(&sf->requeue, 0, sizeof(sf->requeue));
+	sf->zerocopy = false;
+	sf->zc_seq = 0;
+	sf->zc_head = sf->zc_tail = NULL;
+	sf->requeue.cb = ustream_fd_requeue_cb;
 	s->set_read_blocked = ustream_fd_set_read_blocked;
 	s->write = ustream_fd_write;
+	s->writev = ustream_fd_writev;
+	s->sendfile = ustream_fd_sendfile;
+	s->write_zerocopy = NULL;
 	s->free = ustream_fd_free;
 	s->poll = ustream_fd_poll;
 	ustream_fd_set_uloop(s, false);
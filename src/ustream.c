@@ -21,8 +21,10 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include "ustream.h"
+#include "ustream_pool.h"
 
 static void ustream_init_buf(struct ustream_buf *buf, int len)
 {
@@ -49,6 +51,34 @@ static void ustream_add_buf(struct ustream_buf_list *l, struct ustream_buf *buf)
 		l->data_tail = l->head;
 }
 
+/*
+ * a range queued by ustream_sendfile() or ustream_write_zerocopy() sits
+ * in the write list as a buffer without space, which ustream_init_buf()
+ * never creates. the range is kept in its head and its bytes count in
+ * data_bytes.
+ */
+struct ustream_range {
+	int len;
+
+	/* file range, fd < 0 for caller memory */
+	int fd;
+	off_t offset;
+
+	const char *data;
+	ustream_release_cb release;
+	void *priv;
+};
+
+static bool ustream_buf_is_range(struct ustream_buf *buf)
+{
+	return buf->end == buf->head;
+}
+
+static struct ustream_range *ustream_buf_range(struct ustream_buf *buf)
+{
+	return (struct ustream_range *) buf->head;
+}
+
 static bool ustream_can_alloc(struct ustream_buf_list *l)
 {
 	if (l->max_buffers <= 0)
@@ -57,28 +87,62 @@ static bool ustream_can_alloc(struct ustream_buf_list *l)
 	return (l->buffers < l->max_buffers);
 }
 
+static size_t ustream_buf_size(struct ustream *s, int len)
+{
+	return sizeof(struct ustream_buf) + len + s->string_data;
+}
+
 static int ustream_alloc_default(struct ustream *s, struct ustream_buf_list *l)
 {
+	struct ustream_pool *pool = s->loop ? s->loop->buf_pool : NULL;
 	struct ustream_buf *buf;
+	size_t size = ustream_buf_size(s, l->buffer_len);
 
 	if (!ustream_can_alloc(l))
 		return -1;
 
-	buf = malloc(sizeof(*buf) + l->buffer_len + s->string_data);
+	buf = pool ? ustream_pool_get(pool, size) : malloc(size);
+	if (!buf)
+		return -1;
+
 	ustream_init_buf(buf, l->buffer_len);
 	ustream_add_buf(l, buf);
 
 	return 0;
 }
 
-static void ustream_free_buffers(struct ustream_buf_list *l)
+static void ustream_free_malloc(struct ustream *s, struct ustream_buf_list *l, struct ustream_buf *buf)
+{
+	free(buf);
+}
+
+static void ustream_free_default(struct ustream *s, struct ustream_buf_list *l, struct ustream_buf *buf)
+{
+	struct ustream_pool *pool = s->loop ? s->loop->buf_pool : NULL;
+
+	if (pool)
+		ustream_pool_put(pool, buf, ustream_buf_size(s, buf->end - buf->head));
+	else
+		free(buf);
+}
+
+static void ustream_free_buffers(struct ustream *s, struct ustream_buf_list *l)
 {
 	struct ustream_buf *buf = l->head;
 
 	while (buf) {
 		struct ustream_buf *next = buf->next;
 
-		free(buf);
+		if (ustream_buf_is_range(buf)) {
+			struct ustream_range *r = ustream_buf_range(buf);
+
+			/* memory the implementation took over was released by it */
+			if (r->fd < 0 && r->release)
+				r->release(s, r->priv);
+			free(buf);
+		} else {
+			l->free(s, l, buf);
+		}
 		buf = next;
 	}
 	l->head = NULL;
@@ -91,17 +155,18 @@ void ustream_free(struct ustream *s)
 	if (s->free)
 		s->free(s);
 
-	uloop_timeout_cancel(&s->state_change);
-	ustream_free_buffers(&s->r);
-	ustream_free_buffers(&s->w);
+	if (s->loop)
+		uloop_remove_defer(s->loop, &s->state_change);
+	ustream_free_buffers(s, &s->r);
+	ustream_free_buffers(s, &s->w);
 }
 
-static void ustream_state_change_cb(struct uloop_timeout *t)
+static void ustream_state_change_cb(struct uloop_defer *d)
 {
-	struct ustream *s = container_of(t, struct ustream, state_change);
+	struct ustream *s = container_of(d, struct ustream, state_change);
 
 	if (s->write_error)
-		ustream_free_buffers(&s->w);
+		ustream_free_buffers(s, &s->w);
 	if (s->notify_state)
 		s->notify_state(s);
 }
@@ -116,6 +181,8 @@ void ustream_init_defaults(struct ustream *s)
 
 	DEFAULT_SET(s->r.alloc, ustream_alloc_default);
 	DEFAULT_SET(s->w.alloc, ustream_alloc_default);
+	DEFAULT_SET(s->r.free, s->r.alloc == ustream_alloc_default ? ustream_free_default : ustream_free_malloc);
+	DEFAULT_SET(s->w.free, s->w.alloc == ustream_alloc_default ? ustream_free_default : ustream_free_malloc);
 
 	DEFAULT_SET(s->r.min_buffers, 1);
 	DEFAULT_SET(s->r.max_buffers, 1);
@@ -168,7 +235,7 @@ static bool ustream_should_move(struct ustream_buf_list *l, struct ustream_buf *
 	return (buf->end - buf->tail < len);
 }
 
-static void ustream_free_buf(struct ustream_buf_list *l, struct ustream_buf *buf)
+static void ustream_free_buf(struct ustream *s, struct ustream_buf_list *l, struct ustream_buf *buf)
 {
 	if (buf == l->head)
 		l->head = buf->next;
@@ -179,11 +246,16 @@ static void ustream_free_buf(struct ustream_buf_list *l, struct ustream_buf *buf
 	if (buf == l->tail)
 		l->tail = NULL;
 
-	if (--l->buffers >= l->min_buffers) {
+	if (ustream_buf_is_range(buf)) {
 		free(buf);
 		return;
 	}
 
+	if (--l->buffers >= l->min_buffers) {
+		l->free(s, l, buf);
+		return;
+	}
+
 	/* recycle */
 	ustream_init_buf(buf, buf->end - buf->head);
 	ustream_add_buf(l, buf);
@@ -229,7 +301,7 @@ void ustream_consume(struct ustream *s, int len)
 		}
 
 		len -= buf_len;
-		ustream_free_buf(&s->r, buf);
+		ustream_free_buf(s, &s->r, buf);
 		buf = next;
 	} while(len);
 
@@ -295,6 +367,34 @@ char *ustream_reserve(struct ustream *s, int len, int *maxlen)
 	return buf->tail;
 }
 
+int ustream_reserve_iov(struct ustream *s, struct iovec *iov, int iovcnt, int len)
+{
+	struct ustream_buf_list *l = &s->r;
+	struct ustream_buf *buf;
+	int n = 0, avail = 0;
+
+	if (!ustream_prepare_buf(s, l, len)) {
+		__ustream_set_read_blocked(s, s->read_blocked | READ_BLOCKED_FULL);
+		return 0;
+	}
+
+	/* the buffers after data_tail are empty, fill_read walks them in order */
+	buf = l->data_tail;
+	while (n < iovcnt) {
+		iov[n].iov_base = buf->tail;
+		iov[n].iov_len = buf->end - buf->tail;
+		avail += iov[n++].iov_len;
+		if (avail >= len)
+			break;
+
+		if (!buf->next && (!ustream_can_alloc(l) || l->alloc(s, l) < 0))
+			break;
+		buf = buf->next;
+	}
+
+	return n;
+}
+
 void ustream_fill_read(struct ustream *s, int len)
 {
 	struct ustream_buf *buf = s->r.data_tail;
@@ -366,19 +466,90 @@ static void ustream_write_error(struct ustream *s)
 	s->write_error = true;
 }
 
+/*
+ * buffers gathered into one writev call, ustream_write_pending() goes on
+ * with the next batch. the iovec array is on the stack, so keep it small.
+ */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define USTREAM_IOV_MAX	IOV_MAX
+#else
+#define USTREAM_IOV_MAX	64
+#endif
+
+static int ustream_writev_head(struct ustream *s, int *maxlen)
+{
+	struct iovec iov[USTREAM_IOV_MAX];
+	struct ustream_buf *buf;
+	int n = 0;
+
+	*maxlen = 0;
+	for (buf = s->w.head; buf && buf->tail > buf->data && n < USTREAM_IOV_MAX; buf = buf->next) {
+		iov[n].iov_base = buf->data;
+		iov[n].iov_len = buf->tail - buf->data;
+		*maxlen += iov[n++].iov_len;
+	}
+
+	return s->writev(s, iov, n);
+}
+
+/* drop len written bytes from the head of the write buffers */
+static void ustream_consume_written(struct ustream *s, int len)
+{
+	struct ustream_buf *buf;
+	int cur;
+
+	s->w.data_bytes -= len;
+	while (len && (buf = s->w.head)) {
+		if (ustream_buf_is_range(buf)) {
+			struct ustream_range *r = ustream_buf_range(buf);
+
+			cur = r->len;
+			if (len < cur) {
+				/* data is NULL for a file range */
+				if (r->fd >= 0)
+					r->offset += len;
+				else
+					r->data += len;
+				r->len -= len;
+				break;
+			}
+		} else {
+			cur = buf->tail - buf->data;
+			if (len < cur) {
+				buf->data += len;
+				break;
+			}
+		}
+
+		len -= cur;
+		ustream_free_buf(s, &s->w, buf);
+	}
+}
+
 bool ustream_write_pending(struct ustream *s)
 {
-	struct ustream_buf *buf = s->w.head;
-	int wr = 0, len;
+	struct ustream_buf *buf;
+	int wr = 0, len, maxlen;
 
 	if (s->write_error)
 		return false;
 
-	while (buf && s->w.data_bytes) {
-		struct ustream_buf *next = buf->next;
-		int maxlen = buf->tail - buf->data;
+	while ((buf = s->w.head) && s->w.data_bytes) {
+		if (ustream_buf_is_range(buf)) {
+			struct ustream_range *r = ustream_buf_range(buf);
+
+			maxlen = r->len;
+			if (r->fd >= 0)
+				len = s->sendfile(s, r->fd, r->offset, maxlen);
+			else
+				len = s->write_zerocopy(s, r->data, maxlen, r->release, r->priv);
+		} else if (s->writev) {
+			len = ustream_writev_head(s, &maxlen);
+		} else {
+			maxlen = buf->tail - buf->data;
+			len = s->write(s, buf->data, maxlen, !!buf->next);
+		}
 
-		len = s->write(s, buf->data, maxlen, !!buf->next);
 		if (len < 0) {
 			ustream_write_error(s);
 			break;
@@ -388,14 +559,9 @@ bool ustream_write_pending(struct ustream *s)
 			break;
 
 		wr += len;
-		s->w.data_bytes -= len;
-		if (len < maxlen) {
-			buf->data += len;
+		ustream_consume_written(s, len);
+		if (len < maxlen)
 			break;
-		}
-
-		ustream_free_buf(&s->w, buf);
-		buf = next;
 	}
 
 	if (s->notify_write)
@@ -459,6 +625,119 @@ int ustream_write(struct ustream *s, const char *data, int len, bool more)
 	return ustream_write_buffered(s, data, len, wr);
 }
 
+static int ustream_queue_range(struct ustream *s, const struct ustream_range *r)
+{
+	struct ustream_buf_list *l = &s->w;
+	struct ustream_buf *buf, *prev, *next;
+
+	buf = malloc(sizeof(*buf) + sizeof(*r));
+	if (!buf)
+		return -1;
+
+	buf->data = buf->tail = buf->end = buf->head;
+	*ustream_buf_range(buf) = *r;
+
+	/*
+	 * link it in behind the last buffer holding data, ahead of the empty
+	 * ones kept for later writes, which then go behind the range
+	 */
+	for (prev = NULL, next = l->head; next; prev = next, next = next->next) {
+		if (!ustream_buf_is_range(next) && next->tail == next->data)
+			break;
+	}
+
+	buf->next = next;
+	if (prev)
+		prev->next = buf;
+	else
+		l->head = buf;
+	if (!next)
+		l->tail = buf;
+	l->data_tail = next ? next : buf;
+
+	l->data_bytes += r->len;
+	return 0;
+}
+
+int ustream_sendfile(struct ustream *s, int fd, off_t offset, int len)
+{
+	struct ustream_range r = { .fd = fd };
+	int wr = 0;
+
+	if (!s->sendfile || fd < 0 || len < 0)
+		return -1;
+
+	if (s->write_error)
+		return 0;
+
+	if (!s->w.data_bytes) {
+		wr = s->sendfile(s, fd, offset, len);
+		if (wr == len)
+			return wr;
+
+		if (wr < 0) {
+			ustream_write_error(s);
+			return wr;
+		}
+
+		offset += wr;
+		len -= wr;
+	}
+
+	r.offset = offset;
+	r.len = len;
+	if (ustream_queue_range(s, &r) < 0)
+		return wr;
+
+	return wr + len;
+}
+
+int ustream_write_zerocopy(struct ustream *s, const char *data, int len,
+			   ustream_release_cb release, void *priv)
+{
+	struct ustream_range r = { .fd = -1, .release = release, .priv = priv };
+	int wr = 0;
+
+	if (!s->write_zerocopy || s->write_error)
+		goto copy;
+
+	if (!s->w.data_bytes) {
+		wr = s->write_zerocopy(s, data, len, release, priv);
+		if (wr == len)
+			return wr;
+
+		if (wr < 0) {
+			ustream_write_error(s);
+			return wr;
+		}
+
+		data += wr;
+		len -= wr;
+	}
+
+	r.data = data;
+	r.len = len;
+	if (!ustream_queue_range(s, &r))
+		return wr + len;
+
+	/*
+	 * the part that was sent may still be in use, copy the rest and let
+	 * the implementation release the range once it is done with it
+	 */
+	if (wr > 0) {
+		wr += ustream_write(s, data, len, false);
+		s->write_zerocopy(s, data + len, 0, release, priv);
+		return wr;
+	}
+
+copy:
+	wr += ustream_write(s, data, len, false);
+	if (release)
+		release(s, priv);
+
+	return wr;
+}
+
 #define MAX_STACK_BUFLEN	256
 
 int ustream_vprintf(struct ustream *s, const char *format, va_list arg)
@@ -20,10 +20,16 @@
 #define __USTREAM_H
 
 #include <stdarg.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "uloop.h"
 
 struct ustream;
 struct ustream_buf;
+struct ustream_fd_zc;
+
+/* gives memory passed to ustream_write_zerocopy() back to its owner */
+typedef void (*ustream_release_cb)(struct ustream *s, void *priv);
 
 enum read_blocked_reason {
 	READ_BLOCKED_USER = (1 << 0),
@@ -37,6 +43,13 @@ struct ustream_buf_list {
 
 	int (*alloc)(struct ustream *s, struct ustream_buf_list *l);
 
+	/*
+	 * free: (optional)
+	 * gives back a buffer obtained through alloc. defaults to free() for
+	 * a custom alloc and to the loop's buffer pool for the default one.
+	 */
+	void (*free)(struct ustream *s, struct ustream_buf_list *l, struct ustream_buf *buf);
+
 	int data_bytes;
 
 	int min_buffers;
@@ -48,9 +61,12 @@ struct ustream_buf_list {
 
 struct ustream {
 	struct ustream_buf_list r, w;
-	struct uloop_timeout state_change;
+	struct uloop_defer state_change;
 	struct ustream *next;
 
+	/* loop the stream is attached to, set by the ustream implementation */
+	struct uloop *loop;
+
 	/*
 	 * notify_read: (optional)
 	 * called by the ustream core to notify that new data is available
@@ -87,6 +103,38 @@ struct ustream {
 	 */
 	int (*write)(struct ustream *s, const char *buf, int len, bool more);
 
+	/*
+	 * writev: (optional)
+	 * defined by ustream implementation, like write but takes the data of
+	 * several buffered chunks at once. used to flush the write buffers
+	 * with a single call instead of one write per buffer.
+	 * returns the number of bytes accepted, or -1 on a link error
+	 */
+	int (*writev)(struct ustream *s, const struct iovec *iov, int iovcnt);
+
+	/*
+	 * sendfile: (optional)
+	 * defined by ustream implementation, sends len bytes of the file fd
+	 * starting at offset without copying them through the write buffers.
+	 * returns the number of bytes sent, or -1 on a link error or if the
+	 * file ends before the range does
+	 */
+	int (*sendfile)(struct ustream *s, int fd, off_t offset, int len);
+
+	/*
+	 * write_zerocopy: (optional)
+	 * defined by ustream implementation, like write but the data is not
+	 * copied and may still be read after the call returns. once a call
+	 * accepted the last byte of a range, the implementation calls
+	 * release(s, priv) (if set) when buf is no longer used, or on free.
+	 * calls that accept less must not call release, the rest of the range
+	 * is passed by the next call. a call with len 0 ends the range without
+	 * more data.
+	 * returns the number of bytes accepted, or -1 on a link error
+	 */
+	int (*write_zerocopy)(struct ustream *s, const char *buf, int len,
+			      ustream_release_cb release, void *priv);
+
 	/*
 	 * free: (optional)
 	 * defined by ustream implementation, tears down the ustream and frees data
@@ -122,6 +170,22 @@ struct ustream {
 struct ustream_fd {
 	struct ustream stream;
 	struct uloop_fd fd;
+
+	/*
+	 * read_budget / read_budget_calls: (optional)
+	 * bytes and read() calls per wakeup (0: no limit). once either is
+	 * used up, the rest is read from a uloop_defer, which runs once the
+	 * other fds returned by the same wait had their turn, with or without
+	 * drain_events. set them before or after init.
+	 */
+	int read_budget;
+	int read_budget_calls;
+	struct uloop_defer requeue;
+
+	/* MSG_ZEROCOPY sends waiting for completion, see ustream_fd_set_zerocopy() */
+	bool zerocopy;
+	uint32_t zc_seq;
+	struct ustream_fd_zc *zc_head, *zc_tail;
 };
 
 struct ustream_buf {
@@ -134,8 +198,22 @@ struct ustream_buf {
 	char head[];
 };
 
+/* default r.max_buffers of a ustream_fd, a single readv can fill all of them */
+#define USTREAM_FD_READ_BUFFERS	4
+
 /* ustream_fd_init: create a file descriptor ustream (uses uloop) */
-void ustream_fd_init(struct ustream_fd *s, int fd);
+void ustream_fd_init(struct ustream_fd *s, struct uloop *loop, int fd);
+
+/*
+ * ustream_fd_set_zerocopy: send ustream_write_zerocopy() data of a socket
+ * with MSG_ZEROCOPY. completions are read from the socket's error queue
+ * by the loop and the data is released once the kernel is done with it.
+ * writes below USTREAM_FD_ZEROCOPY_MIN bytes are copied as usual. call
+ * after ustream_fd_init(), returns -1 if the socket does not support it.
+ */
+#define USTREAM_FD_ZEROCOPY_MIN	(16 * 1024)
+
+int ustream_fd_set_zerocopy(struct ustream_fd *s);
 
 /* ustream_free: free all buffers and data associated with a ustream */
 void ustream_free(struct ustream *s);
@@ -153,6 +231,27 @@ int ustream_write(struct ustream *s, const char *buf, int len, bool more);
 int ustream_printf(struct ustream *s, const char *format, ...);
 int ustream_vprintf(struct ustream *s, const char *format, va_list arg);
 
+/*
+ * ustream_sendfile: add len bytes of the file fd starting at offset to the
+ * write buffers. they go out in order with the data written before and
+ * after, through the implementation's sendfile without being copied. fd
+ * must stay open until the range was written or the stream is freed.
+ * returns the number of bytes sent or queued, -1 if the ustream does not
+ * support it.
+ */
+int ustream_sendfile(struct ustream *s, int fd, off_t offset, int len);
+
+/*
+ * ustream_write_zerocopy: add len bytes at data to the write buffers
+ * without copying them. data must stay valid and unchanged until
+ * release(s, priv) is called, which happens once the implementation no
+ * longer needs it, or when the stream is freed or hits a write error.
+ * without write_zerocopy support the data is copied and released right
+ * away. returns the number of bytes sent or queued.
+ */
+int ustream_write_zerocopy(struct ustream *s, const char *data, int len,
+			   ustream_release_cb release, void *priv);
+
 /* ustream_get_read_buf: get a pointer to the next read buffer data */
 char *ustream_get_read_buf(struct ustream *s, int *buflen);
 
@@ -194,6 +293,16 @@ void ustream_init_defaults(struct ustream *s);
  */
 char *ustream_reserve(struct ustream *s, int len, int *maxlen);
 
+/*
+ * ustream_reserve_iov: reserve rx buffer space for a vectored read
+ *
+ * describes free space of at least len bytes (not guaranteed to be met)
+ * in up to iovcnt buffers, allocating more of them as far as max_buffers
+ * allows. returns the number of iovecs filled in, 0 if the read buffers
+ * are full. fill them in order with ustream_fill_read().
+ */
+int ustream_reserve_iov(struct ustream *s, struct iovec *iov, int iovcnt, int len);
+
 /* ustream_fill_read: mark rx buffer space as filled */
 void ustream_fill_read(struct ustream *s, int len);
 
@@ -205,7 +314,7 @@ bool ustream_write_pending(struct ustream *s);
 
 static inline void ustream_state_change(struct ustream *s)
 {
-	uloop_timeout_set(&s->state_change, 0);
+	uloop_add_defer(s->loop, &s->state_change);
 }
 
 static inline bool ustream_poll(struct ustream *s)
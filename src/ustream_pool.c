@@ -0,0 +1,234 @@
+/*
+ * ustream_pool - size classed buffer pool for ustream buffers
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ustream_pool.h"
+
+/* buffers are rounded up to whole cache lines */
+#define USTREAM_POOL_ALIGN	64
+#define USTREAM_POOL_ROUND(_size) \
+	(((_size) + USTREAM_POOL_ALIGN - 1) & ~(size_t)(USTREAM_POOL_ALIGN - 1))
+
+struct ustream_pool_obj {
+	struct ustream_pool_obj *next;
+};
+
+/* placed at the start of every slab, the buffers follow it */
+struct ustream_pool_slab {
+	struct ustream_pool_slab *next;
+	size_t size;
+};
+
+#define USTREAM_POOL_SLAB_HEAD	USTREAM_POOL_ROUND(sizeof(struct ustream_pool_slab))
+
+struct ustream_pool_class {
+	size_t size;
+	struct ustream_pool_obj *free;
+
+	/* part of the newest slab that was not handed out yet */
+	char *next, *end;
+};
+
+struct ustream_pool {
+	bool hugepages;
+	/* no hugetlbfs pages were available, only use transparent ones */
+	bool no_hugetlb;
+
+	struct ustream_pool_class classes[USTREAM_POOL_CLASSES];
+	int nclasses;
+
+	struct ustream_pool_slab *slabs;
+	struct ustream_pool_stats stats;
+};
+
+struct ustream_pool *ustream_pool_new(bool hugepages){
+	struct ustream_pool *self = calloc(1, sizeof(*self));
+
+	if (!self)
+		return NULL;
+
+	self->hugepages = hugepages;
+	return self;
+}
+
+void ustream_pool_delete(struct ustream_pool **self){
+	struct ustream_pool_slab *slab, *next;
+
+	if (!*self)
+		return;
+
+	for (slab = (*self)->slabs; slab; slab = next) {
+		next = slab->next;
+		munmap(slab, slab->size);
+	}
+
+	free(*self);
+	*self = NULL;
+}
+
+void ustream_pool_get_stats(struct ustream_pool *self, struct ustream_pool_stats *stats){
+	*stats = self->stats;
+	stats->classes = self->nclasses;
+}
+
+void uloop_set_buffer_pool(struct uloop *self, struct ustream_pool *pool){
+	self->buf_pool = pool;
+}
+
+/*
+ * transparent hugepages only back 2 MiB aligned ranges, so map twice the
+ * size and cut an aligned slab out of it
+ */
+static void *_ustream_pool_map_aligned(size_t size){
+	char *mem, *start;
+
+	mem = mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	start = (char*)(((uintptr_t)mem + size - 1) & ~(uintptr_t)(size - 1));
+	if (start > mem)
+		munmap(mem, start - mem);
+	munmap(start + size, mem + size * 2 - (start + size));
+
+#ifdef MADV_HUGEPAGE
+	madvise(start, size, MADV_HUGEPAGE);
+#endif
+	return start;
+}
+
+static struct ustream_pool_slab *_ustream_pool_new_slab(struct ustream_pool *self){
+	size_t size = self->hugepages ? USTREAM_POOL_HUGE_SLAB : USTREAM_POOL_SLAB;
+	struct ustream_pool_slab *slab = NULL;
+	bool huge = false;
+	void *mem;
+
+#ifdef MAP_HUGETLB
+	if (self->hugepages && !self->no_hugetlb) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) {
+			slab = mem;
+			huge = true;
+		} else {
+			self->no_hugetlb = true;
+		}
+	}
+#endif
+
+	if (!slab && self->hugepages)
+		slab = _ustream_pool_map_aligned(size);
+
+	if (!slab && !self->hugepages) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem != MAP_FAILED)
+			slab = mem;
+	}
+
+	if (!slab)
+		return NULL;
+
+	slab->size = size;
+	slab->next = self->slabs;
+	self->slabs = slab;
+
+	self->stats.mapped += size;
+	self->stats.slabs++;
+	if (huge)
+		self->stats.huge_slabs++;
+
+	return slab;
+}
+
+static struct ustream_pool_class *_ustream_pool_find_class(struct ustream_pool *self, size_t size){
+	int i;
+
+	for (i = 0; i < self->nclasses; i++) {
+		if (self->classes[i].size == size)
+			return &self->classes[i];
+	}
+
+	return NULL;
+}
+
+void *ustream_pool_get(struct ustream_pool *self, size_t size){
+	struct ustream_pool_class *c;
+	struct ustream_pool_slab *slab;
+	struct ustream_pool_obj *obj;
+	void *ptr;
+
+	size = USTREAM_POOL_ROUND(size);
+	c = _ustream_pool_find_class(self, size);
+	if (!c && size <= USTREAM_POOL_MAX_OBJECT && self->nclasses < USTREAM_POOL_CLASSES) {
+		c = &self->classes[self->nclasses++];
+		memset(c, 0, sizeof(*c));
+		c->size = size;
+	}
+
+	if (!c) {
+		self->stats.fallbacks++;
+		return malloc(size);
+	}
+
+	if ((obj = c->free)) {
+		c->free = obj->next;
+		self->stats.hits++;
+		self->stats.cached -= size;
+		ptr = obj;
+	} else {
+		/* the rest of the previous slab is left unused */
+		if ((size_t)(c->end - c->next) < size) {
+			slab = _ustream_pool_new_slab(self);
+			if (!slab)
+				return NULL;
+
+			c->next = (char*)slab + USTREAM_POOL_SLAB_HEAD;
+			c->end = (char*)slab + slab->size;
+		}
+
+		ptr = c->next;
+		c->next += size;
+	}
+
+	self->stats.allocs++;
+	self->stats.in_use += size;
+
+	return ptr;
+}
+
+void ustream_pool_put(struct ustream_pool *self, void *ptr, size_t size){
+	struct ustream_pool_class *c;
+	struct ustream_pool_obj *obj = ptr;
+
+	/* the class of a pooled buffer exists since it was handed out */
+	size = USTREAM_POOL_ROUND(size);
+	c = _ustream_pool_find_class(self, size);
+	if (!c) {
+		free(ptr);
+		return;
+	}
+
+	obj->next = c->free;
+	c->free = obj;
+
+	self->stats.frees++;
+	self->stats.in_use -= size;
+	self->stats.cached += size;
+}
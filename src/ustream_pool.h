@@ -0,0 +1,93 @@
+/*
+ * ustream_pool - size classed buffer pool for ustream buffers
+ *
+ * Copyright (C) 2015 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include "ustream.h"
+
+/* distinct buffer sizes a pool keeps free lists for */
+#define USTREAM_POOL_CLASSES	16
+
+/* larger buffers are not pooled, they come from malloc() */
+#define USTREAM_POOL_MAX_OBJECT	(64 * 1024)
+
+/* slab sizes with and without hugepages */
+#define USTREAM_POOL_SLAB	(256 * 1024)
+#define USTREAM_POOL_HUGE_SLAB	(2 * 1024 * 1024)
+
+/*
+ * A pool hands out stream buffers from slabs it maps itself and keeps the
+ * freed ones on one free list per buffer size, so connections that come
+ * and go reuse the same memory instead of going through malloc() and
+ * spreading their buffers over the heap. Slabs are only unmapped when the
+ * pool is deleted.
+ *
+ * A pool is not thread safe, it belongs to one loop and is only used by
+ * the streams of that loop, from the thread running it.
+ */
+struct ustream_pool;
+
+struct ustream_pool_stats {
+	/* buffers handed out by the pool, and how many came from a free list */
+	uint64_t allocs;
+	uint64_t hits;
+	uint64_t frees;
+	/* buffers too large for the pool or beyond its classes */
+	uint64_t fallbacks;
+
+	/* bytes mapped for slabs, of that held by buffers / on free lists */
+	size_t mapped;
+	size_t in_use;
+	size_t cached;
+
+	int slabs;
+	/* slabs that are backed by hugetlbfs pages */
+	int huge_slabs;
+	int classes;
+};
+
+/*
+ * ustream_pool_new: create a pool. with hugepages slabs are 2 MiB and
+ * taken from hugetlbfs if pages are reserved there, otherwise they are
+ * mapped normally and advised for transparent hugepages.
+ */
+struct ustream_pool *ustream_pool_new(bool hugepages);
+
+/*
+ * ustream_pool_delete: unmap all slabs. streams that still hold buffers of
+ * the pool must be freed before.
+ */
+void ustream_pool_delete(struct ustream_pool **self);
+
+void ustream_pool_get_stats(struct ustream_pool *self, struct ustream_pool_stats *stats);
+
+/*
+ * uloop_set_buffer_pool: let the default allocator of the streams on this
+ * loop take their buffers from pool (NULL: malloc). the pool is not owned
+ * by the loop and must only be changed while no stream of the loop holds
+ * buffers.
+ */
+void uloop_set_buffer_pool(struct uloop *self, struct ustream_pool *pool);
+
+/*
+ * ustream_pool_get / ustream_pool_put: memory for one buffer of size
+ * bytes. put must be passed the size the memory was taken with. this is
+ * what the default ustream allocator does for streams of a loop that has
+ * a pool.
+ */
+void *ustream_pool_get(struct ustream_pool *self, size_t size);
+void ustream_pool_put(struct ustream_pool *self, void *ptr, size_t size);
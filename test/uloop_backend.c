@@ -0,0 +1,132 @@
+#include <sys/socket.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uloop.h"
+
+static struct uloop *loop;
+static int sv[2];
+static char trace[32];
+static int ntrace;
+
+static void log_event(char c)
+{
+	assert(ntrace < (int)sizeof(trace) - 1);
+	trace[ntrace++] = c;
+}
+
+static void guard_cb(struct uloop_timeout *t)
+{
+	/* an event the other backend reports never came */
+	fprintf(stderr, "uloop_backend: %s stalled after \"%s\"\n", uloop_backend_name(loop), trace);
+	assert(0);
+}
+
+static struct uloop_timeout guard = { .cb = guard_cb };
+
+static void post_cb(void *arg)
+{
+	log_event('p');
+	loop->cancelled = true;
+}
+
+static void *poster(void *arg)
+{
+	int ret;
+
+	ret = uloop_post(loop, post_cb, NULL);
+	assert(!ret);
+	return NULL;
+}
+
+static struct uloop_fd fd;
+static struct uloop_timeout quiet;
+
+static void fd_cb(struct uloop_fd *u, unsigned int events)
+{
+	pthread_t thread;
+	char c;
+
+	if (events & ULOOP_WRITE) {
+		log_event('w');
+		uloop_add_fd(loop, u, ULOOP_READ);
+		close(sv[1]);
+		return;
+	}
+
+	assert(events & ULOOP_READ);
+	if (read(u->fd, &c, 1) == 1) {
+		/* one byte at a time, the rest must be reported again */
+		log_event('r');
+		if (ntrace == 2)
+			uloop_add_timeout_ms(loop, &quiet, 50);
+		return;
+	}
+
+	assert(u->eof);
+	log_event('e');
+	uloop_remove_fd(loop, u);
+	pthread_create(&thread, NULL, poster, NULL);
+	pthread_detach(thread);
+}
+
+static void quiet_cb(struct uloop_timeout *t)
+{
+	/* both bytes were read, level triggered interest reports nothing more */
+	log_event('t');
+	uloop_add_fd(loop, &fd, ULOOP_READ | ULOOP_WRITE);
+}
+
+/* the same fd, timeout and post events in the same order on every backend */
+static void run(enum uloop_backend_type backend, char *out)
+{
+	struct uloop_options opts;
+	ssize_t len;
+	int ret;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.backend = backend;
+	loop = uloop_new_options(&opts);
+	assert(loop);
+
+	ntrace = 0;
+	memset(trace, 0, sizeof(trace));
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(!ret);
+	memset(&fd, 0, sizeof(fd));
+	fd.cb = fd_cb;
+	fd.fd = sv[0];
+	memset(&quiet, 0, sizeof(quiet));
+	quiet.cb = quiet_cb;
+
+	uloop_add_fd(loop, &fd, ULOOP_READ);
+	uloop_add_timeout_ms(loop, &guard, 2000);
+	len = write(sv[1], "ab", 2);
+	assert(len == 2);
+
+	while (!loop->cancelled)
+		uloop_process_events(loop);
+
+	printf("uloop_backend: %s: %s\n", uloop_backend_name(loop), trace);
+	strcpy(out, trace);
+
+	uloop_timeout_cancel(&guard);
+	close(sv[0]);
+	uloop_delete(&loop);
+}
+
+int main(void)
+{
+	char epoll[32], io_uring[32];
+
+	run(ULOOP_BACKEND_EPOLL, epoll);
+	run(ULOOP_BACKEND_IO_URING, io_uring);
+
+	assert(!strcmp(epoll, "rrtwep"));
+	assert(!strcmp(io_uring, epoll));
+	printf("uloop_backend: ok\n");
+	return 0;
+}
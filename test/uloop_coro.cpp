@@ -0,0 +1,99 @@
+#include <sys/socket.h>
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+#include "uloop_coro.hpp"
+
+#define SIZE		(1024 * 1024)
+#define SLEEP_MS	20
+
+static std::string sent, got;
+static bool written, read_all;
+
+static void timeout_cb(struct uloop_timeout *)
+{
+	/* a coroutine was never resumed */
+	assert(0);
+}
+
+static uloop_co::task<int> data_size(uloop_co::loop &l)
+{
+	[[maybe_unused]] int64_t start = uloop_now(l.get());
+
+	co_await l.sleep(SLEEP_MS);
+	assert(uloop_now(l.get()) - start >= SLEEP_MS);
+	co_return SIZE;
+}
+
+/* more than the socket takes at once, so drain() waits for the reader */
+static uloop_co::task<> writer(uloop_co::loop &l, int fd)
+{
+	uloop_co::stream s(l, fd);
+	int size = co_await data_size(l);
+	[[maybe_unused]] bool drained;
+	[[maybe_unused]] int ret;
+
+	for (int i = 0; i < size; i++)
+		sent.push_back(static_cast<char>(i * 7));
+
+	ret = s.write(sent);
+	assert(ret == size);
+	assert(s.get()->w.data_bytes > 0);
+
+	drained = co_await s.drain();
+	assert(drained);
+	assert(!s.get()->w.data_bytes);
+	written = true;
+
+	/* the stream closes fd on the way out, the reader sees eof */
+}
+
+static uloop_co::task<> reader(uloop_co::loop &l, int fd)
+{
+	uloop_co::stream s(l, fd);
+
+	for (;;) {
+		std::string_view data = co_await s.read_some();
+
+		if (data.empty())
+			break;
+		got.append(data);
+		s.consume(data.size());
+	}
+
+	assert(s.eof());
+	read_all = true;
+	l.get()->cancelled = true;
+}
+
+int main()
+{
+	struct uloop_timeout timeout = {};
+	struct uloop *ul = uloop_new();
+	int sv[2];
+	[[maybe_unused]] int ret;
+
+	assert(ul);
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(!ret);
+
+	{
+		uloop_co::loop l(ul);
+
+		uloop_co::spawn(reader(l, sv[1]));
+		uloop_co::spawn(writer(l, sv[0]));
+
+		timeout.cb = timeout_cb;
+		uloop_add_timeout_ms(ul, &timeout, 5000);
+		l.run();
+		uloop_timeout_cancel(&timeout);
+	}
+
+	assert(written && read_all);
+	assert(got == sent);
+
+	uloop_delete(&ul);
+	printf("uloop_coro: ok\n");
+	return 0;
+}
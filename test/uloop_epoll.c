@@ -0,0 +1,81 @@
+#include <sys/socket.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uloop.h"
+
+static struct uloop *loop;
+static int sv[2];
+static int reads;
+
+static void timeout_cb(struct uloop_timeout *t)
+{
+	/* the pending byte was never reported again */
+	assert(0);
+}
+
+static struct uloop_timeout timeout = { .cb = timeout_cb };
+
+static void fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	ssize_t len;
+	char c;
+
+	if (!(events & ULOOP_READ))
+		return;
+
+	/* leave data in the socket, an edge triggered fd sees no new edge */
+	len = read(fd->fd, &c, 1);
+	assert(len == 1);
+	if (++reads == 2) {
+		loop->cancelled = true;
+		return;
+	}
+
+	/*
+	 * read interest removed and restored within the same iteration, write
+	 * interest keeps the fd registered like a stream with queued output
+	 */
+	uloop_add_fd(loop, fd, ULOOP_EDGE_TRIGGER | ULOOP_WRITE);
+	uloop_add_fd(loop, fd, ULOOP_EDGE_TRIGGER | ULOOP_READ | ULOOP_WRITE);
+}
+
+/* an edge triggered fd that is blocked and unblocked is re-armed */
+static void test_block_unblock_pending(void)
+{
+	struct uloop_options opts;
+	struct uloop_fd fd = { .cb = fd_cb };
+	ssize_t len;
+	int ret;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.backend = ULOOP_BACKEND_EPOLL;
+	loop = uloop_new_options(&opts);
+	assert(loop);
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(!ret);
+	fd.fd = sv[0];
+	uloop_add_fd(loop, &fd, ULOOP_EDGE_TRIGGER | ULOOP_READ | ULOOP_WRITE);
+	uloop_add_timeout_ms(loop, &timeout, 1000);
+
+	len = write(sv[1], "xy", 2);
+	assert(len == 2);
+	while (!loop->cancelled)
+		uloop_process_events(loop);
+	assert(reads == 2);
+
+	uloop_timeout_cancel(&timeout);
+	uloop_remove_fd(loop, &fd);
+	close(sv[0]);
+	close(sv[1]);
+	uloop_delete(&loop);
+}
+
+int main(void)
+{
+	test_block_unblock_pending();
+	printf("uloop_epoll: ok\n");
+	return 0;
+}
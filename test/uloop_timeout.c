@@ -0,0 +1,166 @@
+#include <sys/socket.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uloop.h"
+
+#define WAIT_MS		500
+#define TIMEOUT_MS	200
+
+static struct uloop *loop;
+static int sv[2];
+static int64_t armed_at;
+static bool fired;
+
+static void *late_writer(void *arg)
+{
+	ssize_t len;
+
+	usleep(WAIT_MS * 1000);
+	len = write(sv[1], "x", 1);
+	assert(len == 1);
+	return NULL;
+}
+
+static void timeout_cb(struct uloop_timeout *t)
+{
+	/* armed relative to the time the fd fired, not to the start of the wait */
+	assert((clock_monotonic_ns() - armed_at) / 1000000 >= TIMEOUT_MS - 10);
+	fired = true;
+	loop->cancelled = true;
+}
+
+static struct uloop_timeout timeout = { .cb = timeout_cb };
+
+static void fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	ssize_t len;
+	char c;
+
+	len = read(fd->fd, &c, 1);
+	assert(len == 1);
+	armed_at = clock_monotonic_ns();
+	assert(armed_at / 1000000 - uloop_now(loop) < 10);
+	uloop_add_timeout_ms(loop, &timeout, TIMEOUT_MS);
+}
+
+/* uloop_now() seen by an fd callback includes the time spent waiting */
+static void test_now_after_wait(void)
+{
+	struct uloop_fd fd = { .cb = fd_cb };
+	pthread_t thread;
+	int ret;
+
+	loop = uloop_new();
+	assert(loop);
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(!ret);
+	fd.fd = sv[0];
+	uloop_add_fd(loop, &fd, ULOOP_READ);
+
+	pthread_create(&thread, NULL, late_writer, NULL);
+	while (!loop->cancelled)
+		uloop_process_events(loop);
+	pthread_join(thread, NULL);
+	assert(fired);
+
+	uloop_remove_fd(loop, &fd);
+	close(sv[0]);
+	close(sv[1]);
+	uloop_delete(&loop);
+}
+
+#define ORDER_TIMEOUTS	12
+
+struct order_timeout {
+	struct uloop_timeout t;
+	int msecs;
+	int64_t armed;
+};
+
+static int order_fired[ORDER_TIMEOUTS];
+static int order_nfired;
+
+static void order_cb(struct uloop_timeout *t)
+{
+	struct order_timeout *o = container_of(t, struct order_timeout, t);
+
+	/* never early, each level of the wheel is cascaded in time */
+	assert((clock_monotonic_ns() - o->armed) / 1000000 >= o->msecs - 1);
+	order_fired[order_nfired++] = o->msecs;
+	if (order_nfired == ORDER_TIMEOUTS)
+		loop->cancelled = true;
+}
+
+/*
+ * timeouts that start out on different levels of the wheel, some right at
+ * the boundaries, fire in the order of their expiry
+ */
+static void test_order(void)
+{
+	static const int msecs[ORDER_TIMEOUTS] = {
+		300, 1, 64, 4100, 63, 65, 4095, 128, 0, 127, 4097, 256,
+	};
+	struct order_timeout timeouts[ORDER_TIMEOUTS];
+	int i;
+
+	loop = uloop_new();
+	assert(loop);
+
+	memset(timeouts, 0, sizeof(timeouts));
+	for (i = 0; i < ORDER_TIMEOUTS; i++) {
+		timeouts[i].t.cb = order_cb;
+		timeouts[i].msecs = msecs[i];
+		timeouts[i].armed = clock_monotonic_ns();
+		uloop_add_timeout_ms(loop, &timeouts[i].t, msecs[i]);
+	}
+
+	while (!loop->cancelled)
+		uloop_process_events(loop);
+
+	for (i = 1; i < ORDER_TIMEOUTS; i++)
+		assert(order_fired[i - 1] <= order_fired[i]);
+
+	uloop_delete(&loop);
+}
+
+static void wakeup_cb(struct uloop_timeout *t)
+{
+	loop->cancelled = true;
+}
+
+/*
+ * a lone timeout beyond the first level costs one wait, not one for every
+ * cascade on the way down
+ */
+static void test_wakeups(int msecs)
+{
+	struct uloop_timeout t = { .cb = wakeup_cb };
+	int calls = 0;
+
+	loop = uloop_new();
+	assert(loop);
+	uloop_add_timeout_ms(loop, &t, msecs);
+
+	/* one call waits, the next fires the timeout */
+	while (!loop->cancelled) {
+		uloop_process_events(loop);
+		calls++;
+	}
+	assert(calls <= 2);
+
+	uloop_delete(&loop);
+}
+
+int main(void)
+{
+	test_now_after_wait();
+	test_order();
+	test_wakeups(300);
+	test_wakeups(5000);
+	printf("uloop_timeout: ok\n");
+	return 0;
+}
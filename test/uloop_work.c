@@ -0,0 +1,150 @@
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "uloop.h"
+#include "uloop_work.h"
+
+#define JOBS		16
+#define STALL_MS	200
+
+static struct uloop *loop;
+static int ran, done, running, max_running;
+static int started, steal_ok;
+
+static void count_done(void *arg)
+{
+	done++;
+}
+
+static void wait_done(int n)
+{
+	while (done < n)
+		uloop_process_events(loop);
+}
+
+static void limit_work(void *arg)
+{
+	int cur = __atomic_add_fetch(&running, 1, __ATOMIC_SEQ_CST);
+	int max = __atomic_load_n(&max_running, __ATOMIC_SEQ_CST);
+
+	while (cur > max && !__atomic_compare_exchange_n(&max_running, &max, cur,
+			false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		;
+	usleep(2000);
+	__atomic_sub_fetch(&running, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&ran, 1, __ATOMIC_SEQ_CST);
+}
+
+/* no more than nthreads jobs of a pool run at the same time */
+static void test_limit(void)
+{
+	struct uloop_work_pool *pool = uloop_work_pool_new(2, 0);
+	int i, ret;
+
+	assert(pool);
+	uloop_set_work_pool(loop, pool);
+	ran = done = 0;
+	for (i = 0; i < JOBS; i++) {
+		ret = uloop_work_submit(loop, limit_work, count_done, NULL);
+		assert(!ret);
+	}
+	wait_done(JOBS);
+	assert(ran == JOBS);
+	assert(max_running >= 1 && max_running <= 2);
+
+	uloop_set_work_pool(loop, NULL);
+	uloop_work_pool_delete(&pool);
+}
+
+static void steal_work(void *arg)
+{
+	__atomic_add_fetch(&ran, 1, __ATOMIC_SEQ_CST);
+}
+
+/* holds its worker until every other job ran, which needs the other to steal */
+static void blocking_work(void *arg)
+{
+	int i;
+
+	__atomic_store_n(&started, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < 2000 && __atomic_load_n(&ran, __ATOMIC_SEQ_CST) < JOBS; i++)
+		usleep(1000);
+	steal_ok = __atomic_load_n(&ran, __ATOMIC_SEQ_CST) == JOBS;
+}
+
+static void test_steal(void)
+{
+	struct uloop_work_pool *pool = uloop_work_pool_new(2, 0);
+	int i, ret;
+
+	assert(pool);
+	uloop_set_work_pool(loop, pool);
+	ran = done = started = 0;
+	ret = uloop_work_submit(loop, blocking_work, count_done, NULL);
+	assert(!ret);
+	while (!__atomic_load_n(&started, __ATOMIC_SEQ_CST))
+		usleep(1000);
+
+	/* submitted round robin, so half of them sit in the busy worker's queue */
+	for (i = 0; i < JOBS; i++) {
+		ret = uloop_work_submit(loop, steal_work, count_done, NULL);
+		assert(!ret);
+	}
+	wait_done(JOBS + 1);
+	assert(steal_ok);
+
+	uloop_set_work_pool(loop, NULL);
+	uloop_work_pool_delete(&pool);
+}
+
+static void stall_work(void *arg)
+{
+	__atomic_store_n(&started, 1, __ATOMIC_SEQ_CST);
+	usleep(STALL_MS * 1000);
+	__atomic_add_fetch(&ran, 1, __ATOMIC_SEQ_CST);
+}
+
+/* delete waits for the running job only and drops the queued ones */
+static void test_delete_queued(void)
+{
+	struct uloop_work_pool *pool = uloop_work_pool_new(1, 0);
+	int64_t start;
+	int i, ret;
+
+	assert(pool);
+	uloop_set_work_pool(loop, pool);
+	ran = done = started = 0;
+	ret = uloop_work_submit(loop, stall_work, count_done, NULL);
+	assert(!ret);
+	while (!__atomic_load_n(&started, __ATOMIC_SEQ_CST))
+		usleep(1000);
+	for (i = 0; i < JOBS; i++) {
+		ret = uloop_work_submit(loop, stall_work, count_done, NULL);
+		assert(!ret);
+	}
+
+	start = clock_monotonic_ns();
+	uloop_set_work_pool(loop, NULL);
+	uloop_work_pool_delete(&pool);
+	assert((clock_monotonic_ns() - start) / 1000000 < 2 * STALL_MS);
+	assert(ran == 1);
+
+	/* everything the pool posted is already queued on the loop */
+	wait_done(1);
+	assert(done == 1);
+}
+
+int main(void)
+{
+	loop = uloop_new();
+	assert(loop);
+
+	test_limit();
+	test_steal();
+	test_delete_queued();
+
+	uloop_delete(&loop);
+	printf("uloop_work: ok\n");
+	return 0;
+}
@@ -0,0 +1,91 @@
+#include <sys/socket.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream.h"
+
+#define BUFFER_LEN	4096
+/* not a multiple of the buffer size, so every wakeup ends mid buffer */
+#define BUDGET		5000
+#define TOTAL		(16 * BUDGET + 100)
+
+static struct uloop *loop;
+static char got[TOTAL];
+static int received, wakeup_bytes;
+
+static void timeout_cb(struct uloop_timeout *t)
+{
+	/* the requeue never delivered the rest */
+	assert(0);
+}
+
+static struct uloop_timeout timeout = { .cb = timeout_cb };
+
+static void notify_read(struct ustream *s, int bytes_new)
+{
+	char *buf;
+	int len;
+
+	wakeup_bytes += bytes_new;
+	while ((buf = ustream_get_read_buf(s, &len))) {
+		memcpy(got + received, buf, len);
+		received += len;
+		ustream_consume(s, len);
+	}
+}
+
+/*
+ * data queued on the socket is read at most BUDGET bytes per wakeup, the
+ * requeue picks up the rest without a new edge from the socket
+ */
+static void test_read_budget(void)
+{
+	struct ustream_fd sf;
+	char data[TOTAL];
+	int sv[2], wakeups = 0, ret, i;
+	ssize_t len;
+
+	loop = uloop_new();
+	assert(loop);
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(!ret);
+
+	for (i = 0; i < TOTAL; i++)
+		data[i] = i * 7;
+	len = write(sv[1], data, TOTAL);
+	assert(len == TOTAL);
+
+	memset(&sf, 0, sizeof(sf));
+	sf.stream.notify_read = notify_read;
+	sf.stream.r.buffer_len = BUFFER_LEN;
+	sf.read_budget = BUDGET;
+	ustream_fd_init(&sf, loop, sv[0]);
+
+	uloop_add_timeout_ms(loop, &timeout, 5000);
+	while (received < TOTAL) {
+		wakeup_bytes = 0;
+		uloop_process_events(loop);
+		assert(wakeup_bytes <= BUDGET);
+		if (wakeup_bytes)
+			wakeups++;
+	}
+
+	assert(received == TOTAL);
+	assert(!memcmp(got, data, TOTAL));
+	assert(wakeups == (TOTAL + BUDGET - 1) / BUDGET);
+
+	uloop_timeout_cancel(&timeout);
+	ustream_free(&sf.stream);
+	close(sv[0]);
+	close(sv[1]);
+	uloop_delete(&loop);
+}
+
+int main(void)
+{
+	test_read_budget();
+	printf("ustream_budget: ok\n");
+	return 0;
+}
@@ -0,0 +1,72 @@
+#include <sys/socket.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream.h"
+
+#define BUFFER_LEN	4096
+#define TOTAL		(USTREAM_FD_READ_BUFFERS * BUFFER_LEN - 100)
+
+static struct uloop *loop;
+static int notifies, largest;
+
+static void notify_read(struct ustream *s, int bytes_new)
+{
+	notifies++;
+	if (bytes_new > largest)
+		largest = bytes_new;
+
+	/* the data is left in the buffers, once it is all there we are done */
+	if (s->r.data_bytes == TOTAL)
+		loop->cancelled = true;
+}
+
+/* data queued on the socket is read into several buffers at once */
+static void test_readv_buffers(void)
+{
+	struct ustream_fd sf;
+	char data[TOTAL], got[TOTAL];
+	int sv[2], ret, i;
+	ssize_t len;
+
+	loop = uloop_new();
+	assert(loop);
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(!ret);
+
+	for (i = 0; i < TOTAL; i++)
+		data[i] = i * 7;
+	len = write(sv[1], data, TOTAL);
+	assert(len == TOTAL);
+
+	memset(&sf, 0, sizeof(sf));
+	sf.stream.notify_read = notify_read;
+	sf.stream.r.buffer_len = BUFFER_LEN;
+	ustream_fd_init(&sf, loop, sv[0]);
+
+	while (!loop->cancelled)
+		uloop_process_events(loop);
+
+	/* filling every buffer took fewer reads than there are buffers */
+	assert(sf.stream.r.buffers == USTREAM_FD_READ_BUFFERS);
+	assert(notifies < USTREAM_FD_READ_BUFFERS);
+	assert(largest > BUFFER_LEN);
+
+	ret = ustream_read(&sf.stream, got, TOTAL);
+	assert(ret == TOTAL);
+	assert(!memcmp(got, data, TOTAL));
+
+	ustream_free(&sf.stream);
+	close(sv[0]);
+	close(sv[1]);
+	uloop_delete(&loop);
+}
+
+int main(void)
+{
+	test_readv_buffers();
+	printf("ustream_readv: ok\n");
+	return 0;
+}
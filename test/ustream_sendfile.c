@@ -0,0 +1,122 @@
+#include <sys/socket.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream.h"
+
+#define HEAD_LEN	(256 * 1024)
+#define FILE_LEN	(128 * 1024)
+#define RANGE_OFFSET	1000
+#define RANGE_LEN	(100 * 1000)
+#define TAIL		"tail"
+#define TOTAL		(HEAD_LEN + RANGE_LEN + 4 + RANGE_LEN)
+
+static struct uloop *loop;
+static char expect[TOTAL], got[TOTAL];
+static int received;
+
+static void timeout_cb(struct uloop_timeout *t)
+{
+	/* the stream stalled */
+	assert(0);
+}
+
+static struct uloop_timeout timeout = { .cb = timeout_cb };
+
+static void peer_cb(struct uloop_fd *fd, unsigned int events)
+{
+	int len;
+
+	len = read(fd->fd, got + received, TOTAL - received);
+	assert(len > 0);
+	received += len;
+	if (received == TOTAL)
+		loop->cancelled = true;
+}
+
+/*
+ * a file range goes out after the data that is still buffered and before
+ * the data written after it, also when it is sent right away
+ */
+static void test_range_order(void)
+{
+	struct uloop_fd peer = { .cb = peer_cb };
+	struct ustream_fd sf;
+	char path[] = "/tmp/ustream_sendfile.XXXXXX";
+	char *head, *file;
+	int sv[2], ffd, ret, n, i;
+	ssize_t len;
+
+	loop = uloop_new();
+	assert(loop);
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(!ret);
+
+	head = malloc(HEAD_LEN);
+	file = malloc(FILE_LEN);
+	assert(head && file);
+	for (i = 0; i < HEAD_LEN; i++)
+		head[i] = i * 7;
+	for (i = 0; i < FILE_LEN; i++)
+		file[i] = i * 13;
+
+	ffd = mkstemp(path);
+	assert(ffd >= 0);
+	unlink(path);
+	len = write(ffd, file, FILE_LEN);
+	assert(len == FILE_LEN);
+
+	n = 0;
+	memcpy(expect + n, head, HEAD_LEN);
+	n += HEAD_LEN;
+	memcpy(expect + n, file + RANGE_OFFSET, RANGE_LEN);
+	n += RANGE_LEN;
+	memcpy(expect + n, TAIL, 4);
+	n += 4;
+	memcpy(expect + n, file + RANGE_OFFSET, RANGE_LEN);
+
+	memset(&sf, 0, sizeof(sf));
+	ustream_fd_init(&sf, loop, sv[0]);
+
+	/* more than the socket takes, the rest stays buffered */
+	ret = ustream_write(&sf.stream, head, HEAD_LEN, false);
+	assert(ret == HEAD_LEN);
+	assert(sf.stream.w.data_bytes > 0);
+	ret = ustream_sendfile(&sf.stream, ffd, RANGE_OFFSET, RANGE_LEN);
+	assert(ret == RANGE_LEN);
+	ret = ustream_printf(&sf.stream, "%s", TAIL);
+	assert(ret == 4);
+
+	/* once the buffers are flushed, the range is sent straight away */
+	peer.fd = sv[1];
+	uloop_add_fd(loop, &peer, ULOOP_READ);
+	uloop_add_timeout_ms(loop, &timeout, 5000);
+	while (sf.stream.w.data_bytes)
+		uloop_process_events(loop);
+	ret = ustream_sendfile(&sf.stream, ffd, RANGE_OFFSET, RANGE_LEN);
+	assert(ret == RANGE_LEN);
+
+	while (!loop->cancelled)
+		uloop_process_events(loop);
+	assert(!memcmp(got, expect, TOTAL));
+
+	uloop_timeout_cancel(&timeout);
+	uloop_remove_fd(loop, &peer);
+	ustream_free(&sf.stream);
+	close(ffd);
+	close(sv[0]);
+	close(sv[1]);
+	uloop_delete(&loop);
+	free(head);
+	free(file);
+}
+
+int main(void)
+{
+	test_range_order();
+	printf("ustream_sendfile: ok\n");
+	return 0;
+}
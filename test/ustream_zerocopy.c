@@ -0,0 +1,179 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ustream.h"
+
+#define SIZE		(256 * 1024)
+#define SIZE_STEP	3000
+#define SIZE_STEPS	24
+#define SNDBUF		4096
+#define PEER_READ	4096
+
+static struct uloop *loop;
+static char *data, *got;
+static int received;
+static int released;
+
+static void timeout_cb(struct uloop_timeout *t)
+{
+	/* the data never arrived, was never released or the hangup was missed */
+	assert(0);
+}
+
+static struct uloop_timeout timeout = { .cb = timeout_cb };
+
+static void release_cb(struct ustream *s, void *priv)
+{
+	assert(priv == data);
+
+	/* only once the stream has handed over the whole range */
+	assert(!s->w.data_bytes);
+	released++;
+}
+
+static void peer_cb(struct uloop_fd *fd, unsigned int events)
+{
+	int len;
+
+	/* small reads keep the sender going in short pieces */
+	len = read(fd->fd, got + received, PEER_READ);
+	assert(len > 0);
+	received += len;
+}
+
+static void tcp_pair(int sv[2])
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int lfd, ret, size = SNDBUF;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(lfd >= 0);
+	ret = bind(lfd, (struct sockaddr *)&sa, sizeof(sa));
+	assert(!ret);
+	ret = listen(lfd, 1);
+	assert(!ret);
+	ret = getsockname(lfd, (struct sockaddr *)&sa, &len);
+	assert(!ret);
+
+	sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+	assert(sv[0] >= 0);
+	/* a small send buffer makes the socket take ranges in pieces */
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	ret = connect(sv[0], (struct sockaddr *)&sa, sizeof(sa));
+	assert(!ret);
+	sv[1] = accept(lfd, NULL, NULL);
+	assert(sv[1] >= 0);
+	close(lfd);
+}
+
+/*
+ * a range the socket takes in several pieces is released once, after the
+ * kernel completed all of them. the size of the last piece depends on the
+ * size of the range, so some of the sizes tried end in a piece below
+ * USTREAM_FD_ZEROCOPY_MIN, which must not be copied and released early.
+ */
+static void test_release_on_completion(int size)
+{
+	struct uloop_fd peer = { .cb = peer_cb };
+	struct ustream_fd sf;
+	int sv[2], ret;
+
+	loop = uloop_new();
+	assert(loop);
+	tcp_pair(sv);
+
+	memset(&sf, 0, sizeof(sf));
+	ustream_fd_init(&sf, loop, sv[0]);
+	if (ustream_fd_set_zerocopy(&sf) < 0) {
+		printf("ustream_zerocopy: MSG_ZEROCOPY not supported, skipped\n");
+		exit(77);
+	}
+
+	received = released = 0;
+	ret = ustream_write_zerocopy(&sf.stream, data, size, release_cb, data);
+	assert(ret == size);
+	/* the socket buffer cannot take it all, the rest waits as a range */
+	assert(sf.stream.w.data_bytes > 0);
+	assert(!released);
+
+	peer.fd = sv[1];
+	uloop_add_fd(loop, &peer, ULOOP_READ);
+	uloop_add_timeout_ms(loop, &timeout, 5000);
+	while (received < size || !released)
+		uloop_process_events(loop);
+
+	assert(released == 1);
+	assert(!memcmp(got, data, size));
+
+	uloop_timeout_cancel(&timeout);
+	uloop_remove_fd(loop, &peer);
+	ustream_free(&sf.stream);
+	assert(released == 1);
+	close(sv[0]);
+	close(sv[1]);
+	uloop_delete(&loop);
+}
+
+/*
+ * the error queue and a hangup both wake the stream as an error. SO_ERROR
+ * reads 0 for a hangup, which must still fail the stream for writing.
+ */
+static void test_hangup(void)
+{
+	struct ustream_fd sf;
+	int sv[2], ret;
+
+	loop = uloop_new();
+	assert(loop);
+	tcp_pair(sv);
+
+	memset(&sf, 0, sizeof(sf));
+	ustream_fd_init(&sf, loop, sv[0]);
+	ret = ustream_fd_set_zerocopy(&sf);
+	assert(!ret);
+
+	/* the peer is gone and we are done writing: EPOLLHUP without an error */
+	close(sv[1]);
+	ret = shutdown(sv[0], SHUT_WR);
+	assert(!ret);
+
+	uloop_add_timeout_ms(loop, &timeout, 5000);
+	while (!sf.stream.write_error)
+		uloop_process_events(loop);
+
+	uloop_timeout_cancel(&timeout);
+	ustream_free(&sf.stream);
+	close(sv[0]);
+	uloop_delete(&loop);
+}
+
+int main(void)
+{
+	int i, max = SIZE + SIZE_STEP * SIZE_STEPS;
+
+	data = malloc(max);
+	got = malloc(max);
+	assert(data && got);
+	for (i = 0; i < max; i++)
+		data[i] = i * 7;
+
+	for (i = 0; i < SIZE_STEPS; i++)
+		test_release_on_completion(SIZE + i * SIZE_STEP);
+	test_hangup();
+
+	free(data);
+	free(got);
+	printf("ustream_zerocopy: ok\n");
+	return 0;
+}